@@ -0,0 +1,912 @@
+/*
+ *
+ * Copyright 2020 The University of Queensland
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Microbenchmarks for metrics.c on its own, against a synthetic registry of
+ * counters and no collectors, so that they build and run anywhere (see the
+ * Makefile).
+ *
+ * Each benchmark prints a tab-separated line per series count, with the best
+ * time per operation over as many rounds as fit in -t msec, and allocations
+ * per operation. Runs from two commits can be compared with diff(1).
+ *
+ * The publish benchmarks also check every snapshot against a fresh render,
+ * and exit with EXIT_ERROR if they differ. The workers benchmark doesn't use
+ * the synthetic registry and only runs once.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <err.h>
+
+#include "log.h"
+#include "metrics.h"
+
+extern FILE *logfile;
+
+#define	MAX_LABELS	4
+#define	MAX_SERIES_COUNTS	8
+
+/*
+ * Allocations are counted by wrapping the allocator, which glibc exports
+ * under these names so it can be replaced. Elsewhere they're not counted.
+ */
+#if defined(__GLIBC__)
+#define	COUNT_ALLOCS
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+/* the benchmarks are single-threaded */
+static uint64_t nallocs;
+
+void *
+malloc(size_t n)
+{
+	++nallocs;
+	return (__libc_malloc(n));
+}
+
+void *
+calloc(size_t n, size_t sz)
+{
+	++nallocs;
+	return (__libc_calloc(n, sz));
+}
+
+void *
+realloc(void *p, size_t n)
+{
+	++nallocs;
+	return (__libc_realloc(p, n));
+}
+#else
+static uint64_t nallocs;
+#endif
+
+/* The shape of the registry: nmetrics counters with the same labels */
+struct shape {
+	size_t nmetrics;
+	size_t nlabels;
+	/* string labels, or uint64 ones */
+	int strings;
+	enum registry_index index;
+	enum registry_layout layout;
+};
+
+/*
+ * Series s is in metric s % nmetrics, with the label values of row
+ * s / nmetrics. The first label is unique to each row, and the others take
+ * one of 8 values, like a state or a direction would.
+ */
+struct bench {
+	struct shape sh;
+	struct registry *r;
+	struct metric **metrics;
+	size_t nseries;
+	size_t nrows;
+	union metric_label_val *lv;
+	char *strs;
+	/* whether every series currently exists */
+	int complete;
+	/* rounds of the current benchmark so far */
+	uint64_t round;
+	size_t removed;
+	struct wbuf *out;
+	/* the bench round each metric's values last changed in, for publish */
+	uint64_t *mround;
+	struct wbuf *fresh;
+
+	/* the registry and handles for the collect benchmark */
+	struct registry *cr;
+	struct metric **cmetrics;
+	struct metric_val **cvals;
+	uint64_t *cv;
+	/* passes of its module's mm_collect, so each one changes values */
+	uint64_t cround;
+};
+
+struct benchmark {
+	const char *bm_name;
+	/* Untimed: gets ready for a round */
+	void (*bm_setup)(struct bench *);
+	/* Timed: returns the number of operations done */
+	size_t (*bm_run)(struct bench *);
+};
+
+static const union metric_label_val *
+series_labels(const struct bench *b, size_t s)
+{
+	return (&b->lv[(s / b->sh.nmetrics) * b->sh.nlabels]);
+}
+
+#define	S(i)	lv[i].mlv_string
+#define	U(i)	lv[i].mlv_uint64
+
+static int
+update(struct bench *b, size_t s, uint64_t v)
+{
+	struct metric *m = b->metrics[s % b->sh.nmetrics];
+	const union metric_label_val *lv = series_labels(b, s);
+
+	switch (b->sh.nlabels) {
+	case 1:
+		return (b->sh.strings ? metric_update(m, S(0), v) :
+		    metric_update(m, U(0), v));
+	case 2:
+		return (b->sh.strings ? metric_update(m, S(0), S(1), v) :
+		    metric_update(m, U(0), U(1), v));
+	case 3:
+		return (b->sh.strings ?
+		    metric_update(m, S(0), S(1), S(2), v) :
+		    metric_update(m, U(0), U(1), U(2), v));
+	case 4:
+		return (b->sh.strings ?
+		    metric_update(m, S(0), S(1), S(2), S(3), v) :
+		    metric_update(m, U(0), U(1), U(2), U(3), v));
+	}
+	return (metric_update(m, v));
+}
+
+static int
+inc(struct bench *b, size_t s)
+{
+	struct metric *m = b->metrics[s % b->sh.nmetrics];
+	const union metric_label_val *lv = series_labels(b, s);
+
+	switch (b->sh.nlabels) {
+	case 1:
+		return (b->sh.strings ? metric_inc(m, S(0)) :
+		    metric_inc(m, U(0)));
+	case 2:
+		return (b->sh.strings ? metric_inc(m, S(0), S(1)) :
+		    metric_inc(m, U(0), U(1)));
+	case 3:
+		return (b->sh.strings ? metric_inc(m, S(0), S(1), S(2)) :
+		    metric_inc(m, U(0), U(1), U(2)));
+	case 4:
+		return (b->sh.strings ? metric_inc(m, S(0), S(1), S(2), S(3)) :
+		    metric_inc(m, U(0), U(1), U(2), U(3)));
+	}
+	return (metric_inc(m));
+}
+
+#undef	S
+#undef	U
+
+static void
+fill(struct bench *b)
+{
+	size_t s;
+
+	if (b->complete)
+		return;
+	for (s = 0; s < b->nseries; ++s)
+		update(b, s, s);
+	b->complete = 1;
+}
+
+static void
+setup_collected(struct bench *b)
+{
+	fill(b);
+	registry_collect(b->r);
+}
+
+static void
+setup_empty(struct bench *b)
+{
+	size_t i;
+
+	for (i = 0; i < b->sh.nmetrics; ++i)
+		metric_clear(b->metrics[i]);
+	b->complete = 0;
+	registry_collect(b->r);
+}
+
+/* Leaves every other row stale, for metric_clear_old_values() */
+static void
+setup_half(struct bench *b)
+{
+	size_t s;
+
+	fill(b);
+	registry_collect(b->r);
+	b->removed = 0;
+	for (s = 0; s < b->nseries; ++s) {
+		if ((s / b->sh.nmetrics) % 2 == 0)
+			update(b, s, s);
+		else
+			++b->removed;
+	}
+	b->complete = 0;
+}
+
+static void
+setup_filled(struct bench *b)
+{
+	fill(b);
+}
+
+static size_t
+run_update(struct bench *b)
+{
+	size_t s;
+
+	for (s = 0; s < b->nseries; ++s)
+		update(b, s, s + b->round);
+	b->complete = 1;
+	return (b->nseries);
+}
+
+static size_t
+run_inc(struct bench *b)
+{
+	size_t s;
+
+	for (s = 0; s < b->nseries; ++s)
+		inc(b, s);
+	return (b->nseries);
+}
+
+static size_t
+run_clear_old(struct bench *b)
+{
+	size_t i;
+
+	for (i = 0; i < b->sh.nmetrics; ++i)
+		metric_clear_old_values(b->metrics[i]);
+	return (b->removed);
+}
+
+static size_t
+run_collect(struct bench *b)
+{
+	registry_collect(b->cr);
+	return (b->nseries);
+}
+
+/*
+ * The collect registry's handles, set outside of a collection: one call per
+ * series, then one metric_vals_set_uint64() per row.
+ */
+static size_t
+run_set_each(struct bench *b)
+{
+	size_t s;
+
+	for (s = 0; s < b->nseries; ++s)
+		metric_val_set_uint64(b->cvals[s], s + b->round);
+	return (b->nseries);
+}
+
+static size_t
+run_set_batch(struct bench *b)
+{
+	size_t row, i;
+
+	for (row = 0; row < b->nrows; ++row) {
+		for (i = 0; i < b->sh.nmetrics; ++i)
+			b->cv[i] = row * b->sh.nmetrics + i + b->round;
+		metric_vals_set_uint64(&b->cvals[row * b->sh.nmetrics],
+		    b->cv, b->sh.nmetrics);
+	}
+	return (b->nseries);
+}
+
+static size_t
+render(struct bench *b, enum metrics_format fmt)
+{
+	wbuf_reset(b->out);
+	print_registry_fmt(b->out, b->r, fmt);
+	return (b->nseries);
+}
+
+static size_t
+run_render_text(struct bench *b)
+{
+	return (render(b, METRICS_FMT_TEXT));
+}
+
+static size_t
+run_render_om(struct bench *b)
+{
+	return (render(b, METRICS_FMT_OPENMETRICS));
+}
+
+static size_t
+run_render_pb(struct bench *b)
+{
+	return (render(b, METRICS_FMT_PROTOBUF));
+}
+
+/*
+ * The last snapshot has to be what rendering the registry from scratch would
+ * give: a metric wrongly left clean would go on being served stale.
+ */
+static void
+check_snapshot(struct bench *b, const char *name)
+{
+	static const char *fmt_names[METRICS_FMT_COUNT] = {
+		[METRICS_FMT_TEXT] = "text",
+		[METRICS_FMT_OPENMETRICS] = "openmetrics",
+		[METRICS_FMT_PROTOBUF] = "protobuf"
+	};
+	struct snapshot *snap;
+	enum metrics_format fmt;
+	size_t len;
+
+	snap = registry_snapshot(b->r);
+	if (snap == NULL)
+		errx(EXIT_ERROR, "%s: nothing published", name);
+	for (fmt = 0; fmt < METRICS_FMT_COUNT; ++fmt) {
+		wbuf_reset(b->fresh);
+		print_registry_fmt(b->fresh, b->r, fmt);
+		len = snapshot_len(snap, fmt);
+		if (len != wbuf_len(b->fresh) || bcmp(snapshot_data(snap, fmt),
+		    wbuf_data(b->fresh), len) != 0) {
+			errx(EXIT_ERROR, "%s: %s snapshot differs from a fresh "
+			    "render in round %llu", name, fmt_names[fmt],
+			    (unsigned long long)b->round);
+		}
+	}
+	snapshot_release(snap);
+}
+
+/*
+ * Checks the last snapshot, then changes the values of one metric in every,
+ * taking turns (all of them when every is 1). Of the rest, random rows are
+ * set to the values they already have, which mustn't make them dirty, and
+ * now and then a changed metric is cleared first, so its series are made
+ * anew.
+ */
+static void
+publish_prepare(struct bench *b, const char *name, u_int every)
+{
+	struct metric *m;
+	size_t s, i;
+	int change;
+
+	if (b->round == 0) {
+		registry_want_format(b->r, METRICS_FMT_OPENMETRICS);
+		registry_want_format(b->r, METRICS_FMT_PROTOBUF);
+		srandom(1);
+		bzero(b->mround, b->sh.nmetrics * sizeof (uint64_t));
+		for (s = 0; s < b->nseries; ++s)
+			update(b, s, s);
+		b->complete = 1;
+		return;
+	}
+	check_snapshot(b, name);
+
+	for (i = 0; i < b->sh.nmetrics; ++i) {
+		m = b->metrics[i];
+		change = ((i + b->round) % every == 0);
+		if (change) {
+			b->mround[i] = b->round;
+			if (random() % 8 == 0)
+				metric_clear(m);
+		}
+		for (s = i; s < b->nseries; s += b->sh.nmetrics) {
+			if (change || random() % 8 == 0)
+				update(b, s, s + b->mround[i]);
+		}
+	}
+}
+
+static void
+setup_publish_mix(struct bench *b)
+{
+	publish_prepare(b, "publish_mix", 4);
+}
+
+static void
+setup_publish_dirty(struct bench *b)
+{
+	publish_prepare(b, "publish_dirty", 1);
+}
+
+/* Every format, as a server which has been asked for each would */
+static size_t
+run_publish(struct bench *b)
+{
+	registry_publish(b->r);
+	return (b->nseries);
+}
+
+/*
+ * Fractional values, as rates and ratios give: half with a few decimal
+ * places, half needing all 17 digits.
+ */
+static size_t
+run_render_double(struct bench *b)
+{
+	size_t s;
+	double v;
+
+	wbuf_reset(b->out);
+	for (s = 0; s < b->nseries; ++s) {
+		v = (double)(s + b->round);
+		wbuf_put_double(b->out, (s % 2) ? v / 7 : v / 1000 + 0.5);
+		wbuf_putc(b->out, '\n');
+	}
+	return (b->nseries);
+}
+
+/*
+ * update_miss creates every series, and clear_old's operations are the
+ * values it removes. The others go over every series once.
+ */
+static const struct benchmark benchmarks[] = {
+	{ "update_hit",		setup_collected,	run_update },
+	{ "update_miss",	setup_empty,		run_update },
+	{ "inc",		setup_collected,	run_inc },
+	{ "clear_old",		setup_half,		run_clear_old },
+	{ "collect",		NULL,			run_collect },
+	{ "set_each",		NULL,			run_set_each },
+	{ "set_batch",		NULL,			run_set_batch },
+	{ "render_text",	setup_filled,		run_render_text },
+	{ "render_om",		setup_filled,		run_render_om },
+	{ "render_pb",		setup_filled,		run_render_pb },
+	{ "publish_mix",	setup_publish_mix,	run_publish },
+	{ "publish_dirty",	setup_publish_dirty,	run_publish },
+	{ "render_double",	NULL,			run_render_double },
+	{ NULL,			NULL,			NULL }
+};
+
+/*
+ * The collect benchmark's registry has a single module, which sets all of
+ * its series through handles, as the collectors do.
+ */
+static struct bench *collect_bench;
+static const struct metric_ops bench_metric_ops = { NULL, NULL };
+
+static void
+bench_register(struct registry *r, void **modpriv)
+{
+	struct bench *b = collect_bench;
+	struct metric_desc *d;
+	struct metric_label_desc *ld;
+	char **names;
+	size_t i, row;
+
+	d = calloc(b->sh.nmetrics, sizeof (struct metric_desc));
+	ld = calloc(b->sh.nlabels, sizeof (struct metric_label_desc));
+	names = calloc(b->sh.nmetrics + b->sh.nlabels, sizeof (char *));
+	b->cmetrics = calloc(b->sh.nmetrics, sizeof (struct metric *));
+	b->cvals = calloc(b->nseries, sizeof (struct metric_val *));
+	b->cv = calloc(b->sh.nmetrics, sizeof (uint64_t));
+	if (d == NULL || ld == NULL || names == NULL || b->cmetrics == NULL ||
+	    b->cvals == NULL || b->cv == NULL)
+		tserr(EXIT_MEMORY, "calloc");
+
+	for (i = 0; i < b->sh.nlabels; ++i) {
+		if (asprintf(&names[i], "l%zu", i) < 0)
+			tserr(EXIT_MEMORY, "asprintf");
+		ld[i].mld_name = names[i];
+		ld[i].mld_type = b->sh.strings ? METRIC_VAL_STRING :
+		    METRIC_VAL_UINT64;
+	}
+	for (i = 0; i < b->sh.nmetrics; ++i) {
+		if (asprintf(&names[b->sh.nlabels + i], "bench_%zu_total",
+		    i) < 0)
+			tserr(EXIT_MEMORY, "asprintf");
+		d[i].md_name = names[b->sh.nlabels + i];
+		d[i].md_help = "Benchmark counter";
+		d[i].md_type = METRIC_COUNTER;
+		d[i].md_val_type = METRIC_VAL_UINT64;
+		d[i].md_labels = ld;
+		d[i].md_nlabels = b->sh.nlabels;
+	}
+	metric_new_table(r, d, b->sh.nmetrics, NULL, &bench_metric_ops,
+	    b->cmetrics);
+	for (row = 0; row < b->nrows; ++row) {
+		metric_val_get_table(b->cmetrics, b->sh.nmetrics,
+		    &b->lv[row * b->sh.nlabels],
+		    &b->cvals[row * b->sh.nmetrics]);
+	}
+
+	for (i = 0; i < b->sh.nmetrics + b->sh.nlabels; ++i)
+		free(names[i]);
+	free(names);
+	free(ld);
+	free(d);
+	*modpriv = b;
+}
+
+static int
+bench_collect(void *modpriv)
+{
+	struct bench *b = modpriv;
+	size_t row, i;
+
+	++b->cround;
+	for (row = 0; row < b->nrows; ++row) {
+		for (i = 0; i < b->sh.nmetrics; ++i)
+			b->cv[i] = row + i + b->cround;
+		metric_vals_set_uint64(&b->cvals[row * b->sh.nmetrics],
+		    b->cv, b->sh.nmetrics);
+	}
+	return (0);
+}
+
+static void
+bench_free(void *modpriv)
+{
+	struct bench *b = modpriv;
+
+	metric_val_release_table(b->cvals, b->nseries);
+	free(b->cvals);
+	free(b->cmetrics);
+	free(b->cv);
+}
+
+static struct metrics_module_ops bench_module_ops = {
+	.mm_name = "bench",
+	.mm_register = bench_register,
+	.mm_collect = bench_collect,
+	.mm_free = bench_free
+};
+
+static struct metrics_module_ops *const bench_modules[] = {
+	&bench_module_ops,
+	NULL
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * The workers benchmark: modules which only sleep, as ones waiting on the
+ * kernel or a slow ioctl do, collected with different numbers of workers.
+ * The thread calling registry_collect() takes modules too, so n workers
+ * collect up to n + 1 at once. It doesn't depend on the series count, so it
+ * runs once, on its own.
+ */
+#define	NSLEEPERS	7
+#define	SLEEP_MS	20
+
+static const unsigned int worker_counts[] = { 0, 1, 2, 4, NSLEEPERS };
+
+static void
+sleeper_register(struct registry *r, void **modpriv)
+{
+	*modpriv = NULL;
+}
+
+static int
+sleeper_collect(void *modpriv)
+{
+	struct timespec ts = { 0, SLEEP_MS * 1000000L };
+
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+	return (0);
+}
+
+static void
+run_workers(void)
+{
+	static const char *names[NSLEEPERS] = {
+		"sleep0", "sleep1", "sleep2", "sleep3", "sleep4", "sleep5",
+		"sleep6"
+	};
+	struct metrics_module_ops ops[NSLEEPERS];
+	struct metrics_module_ops *mods[NSLEEPERS + 1];
+	struct registry *r;
+	uint64_t start, t, best, serial = 0;
+	size_t i;
+	int round, rc;
+
+	bzero(ops, sizeof (ops));
+	for (i = 0; i < NSLEEPERS; ++i) {
+		ops[i].mm_name = names[i];
+		ops[i].mm_register = sleeper_register;
+		ops[i].mm_collect = sleeper_collect;
+		mods[i] = &ops[i];
+	}
+	mods[NSLEEPERS] = NULL;
+
+	printf("# benchmark\tworkers\tms/collect\tspeedup\n");
+	for (i = 0; i < sizeof (worker_counts) / sizeof (unsigned int); ++i) {
+		r = registry_build(mods);
+		rc = registry_set_workers(r, worker_counts[i]);
+		if (rc != 0) {
+			errno = rc;
+			err(EXIT_ERROR, "registry_set_workers");
+		}
+		best = 0;
+		for (round = 0; round < 3; ++round) {
+			start = now_ns();
+			registry_collect(r);
+			t = now_ns() - start;
+			if (round == 0 || t < best)
+				best = t;
+		}
+		if (worker_counts[i] == 0)
+			serial = best;
+		printf("workers\t%u\t%.1f\t%.2f\n", worker_counts[i],
+		    best / 1e6, (double)serial / best);
+		fflush(stdout);
+		registry_free(r);
+	}
+}
+
+static struct bench *
+bench_new(const struct shape *sh, size_t nseries)
+{
+	struct bench *b;
+	struct label *l[MAX_LABELS];
+	char name[64], *p;
+	size_t i, j, row;
+
+	b = calloc(1, sizeof (struct bench));
+	if (b == NULL)
+		tserr(EXIT_MEMORY, "calloc");
+	b->sh = *sh;
+	b->nrows = (nseries + sh->nmetrics - 1) / sh->nmetrics;
+	/* without labels, each metric only has the one series */
+	if (sh->nlabels == 0)
+		b->nrows = 1;
+	b->nseries = b->nrows * sh->nmetrics;
+
+	b->lv = calloc(b->nrows * sh->nlabels + 1,
+	    sizeof (union metric_label_val));
+	b->strs = calloc(b->nrows * sh->nlabels + 1, 16);
+	b->metrics = calloc(sh->nmetrics, sizeof (struct metric *));
+	if (b->lv == NULL || b->strs == NULL || b->metrics == NULL)
+		tserr(EXIT_MEMORY, "calloc");
+	for (row = 0; row < b->nrows; ++row) {
+		for (j = 0; j < sh->nlabels; ++j) {
+			i = row * sh->nlabels + j;
+			b->lv[i].mlv_uint64 = (j == 0) ? row : row % 8;
+			if (sh->strings) {
+				p = &b->strs[i * 16];
+				snprintf(p, 16, "v%llu",
+				    (unsigned long long)b->lv[i].mlv_uint64);
+				b->lv[i].mlv_string = p;
+			}
+		}
+	}
+
+	b->r = registry_new_empty();
+	registry_set_index(b->r, sh->index);
+	registry_set_layout(b->r, sh->layout);
+	for (i = 0; i < sh->nmetrics; ++i) {
+		for (j = 0; j < MAX_LABELS; ++j) {
+			l[j] = NULL;
+			if (j >= sh->nlabels)
+				continue;
+			snprintf(name, sizeof (name), "l%zu", j);
+			l[j] = metric_label_new(name, sh->strings ?
+			    METRIC_VAL_STRING : METRIC_VAL_UINT64);
+		}
+		snprintf(name, sizeof (name), "bench_%zu_total", i);
+		b->metrics[i] = metric_new(b->r, name, "Benchmark counter",
+		    METRIC_COUNTER, METRIC_VAL_UINT64, NULL, &bench_metric_ops,
+		    l[0], l[1], l[2], l[3], NULL);
+	}
+
+	collect_bench = b;
+	b->cr = registry_build(bench_modules);
+	registry_set_index(b->cr, sh->index);
+	registry_set_layout(b->cr, sh->layout);
+
+	b->mround = calloc(sh->nmetrics, sizeof (uint64_t));
+	if (b->mround == NULL)
+		tserr(EXIT_MEMORY, "calloc");
+	b->out = wbuf_new(64 * nseries);
+	b->fresh = wbuf_new(64 * nseries);
+	return (b);
+}
+
+static void
+bench_free_all(struct bench *b)
+{
+	registry_free(b->cr);
+	registry_free(b->r);
+	wbuf_free(b->out);
+	wbuf_free(b->fresh);
+	free(b->mround);
+	free(b->metrics);
+	free(b->lv);
+	free(b->strs);
+	free(b);
+}
+
+static void
+run_benchmark(struct bench *b, const struct benchmark *bm, uint64_t min_ns)
+{
+	uint64_t start, t, total = 0, allocs = 0, ops = 0;
+	double best = -1, nsop;
+	size_t n;
+
+	for (b->round = 0; b->round < 3 || total < min_ns; ++b->round) {
+		if (bm->bm_setup != NULL)
+			bm->bm_setup(b);
+		allocs -= nallocs;
+		start = now_ns();
+		n = bm->bm_run(b);
+		t = now_ns() - start;
+		allocs += nallocs;
+		total += t;
+		ops += n;
+		if (n == 0)
+			continue;
+		nsop = (double)t / n;
+		if (best < 0 || nsop < best)
+			best = nsop;
+	}
+
+	printf("%s\t%zu\t%.1f\t", bm->bm_name, b->nseries, best);
+#if defined(COUNT_ALLOCS)
+	printf("%.2f\n", ops > 0 ? (double)allocs / ops : 0.0);
+#else
+	printf("-\n");
+#endif
+	fflush(stdout);
+}
+
+static void
+usage(const char *arg0)
+{
+	fprintf(stderr, "usage: %s [-CH] [-l labels] [-m metrics] "
+	    "[-n series[,series...]] [-t msec] [benchmark ...]\n", arg0);
+	fprintf(stderr, "labels is a count and a type, like 2s (two string "
+	    "labels) or 1u (one uint64)\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *optstring = "CHl:m:n:t:";
+	struct shape sh;
+	struct bench *b;
+	const struct benchmark *bm;
+	size_t series[MAX_SERIES_COUNTS] = { 1000, 10000, 100000 };
+	size_t nseries = 3, i;
+	unsigned long min_ms = 200, parsed;
+	char *p, *tok;
+	int c, j, want, workers, others;
+
+	logfile = stderr;
+
+	bzero(&sh, sizeof (sh));
+	sh.nmetrics = 10;
+	sh.nlabels = 2;
+	sh.strings = 1;
+	sh.index = REGISTRY_INDEX_TREE;
+	sh.layout = REGISTRY_LAYOUT_ROWS;
+
+	while ((c = getopt(argc, argv, optstring)) != -1) {
+		switch (c) {
+		case 'C':
+			sh.layout = REGISTRY_LAYOUT_COLUMNS;
+			break;
+		case 'H':
+			sh.index = REGISTRY_INDEX_HASH;
+			break;
+		case 'l':
+			errno = 0;
+			parsed = strtoul(optarg, &p, 10);
+			if (errno != 0 || parsed > MAX_LABELS ||
+			    (*p != 's' && *p != 'u' && !(*p == '\0' &&
+			    parsed == 0)) || (*p != '\0' && p[1] != '\0')) {
+				errx(EXIT_USAGE, "invalid argument for "
+				    "-l: '%s'", optarg);
+			}
+			sh.nlabels = parsed;
+			sh.strings = (*p == 's');
+			break;
+		case 'm':
+			errno = 0;
+			parsed = strtoul(optarg, &p, 0);
+			if (errno != 0 || *p != '\0' || parsed == 0 ||
+			    parsed > 1000) {
+				errx(EXIT_USAGE, "invalid argument for "
+				    "-m: '%s'", optarg);
+			}
+			sh.nmetrics = parsed;
+			break;
+		case 'n':
+			nseries = 0;
+			while ((tok = strsep(&optarg, ",")) != NULL) {
+				errno = 0;
+				parsed = strtoul(tok, &p, 0);
+				if (errno != 0 || *p != '\0' || parsed == 0 ||
+				    nseries == MAX_SERIES_COUNTS) {
+					errx(EXIT_USAGE, "invalid argument "
+					    "for -n: '%s'", tok);
+				}
+				series[nseries++] = parsed;
+			}
+			break;
+		case 't':
+			errno = 0;
+			min_ms = strtoul(optarg, &p, 0);
+			if (errno != 0 || *p != '\0') {
+				errx(EXIT_USAGE, "invalid argument for "
+				    "-t: '%s'", optarg);
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return (EXIT_USAGE);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	workers = others = (argc == 0);
+	for (j = 0; j < argc; ++j) {
+		if (strcmp(argv[j], "workers") == 0) {
+			workers = 1;
+			continue;
+		}
+		for (bm = benchmarks; bm->bm_name != NULL; ++bm) {
+			if (strcmp(bm->bm_name, argv[j]) == 0)
+				break;
+		}
+		if (bm->bm_name == NULL)
+			errx(EXIT_USAGE, "unknown benchmark '%s'", argv[j]);
+		others = 1;
+	}
+
+	printf("# metrics=%zu labels=%zu%s index=%s layout=%s\n",
+	    sh.nmetrics, sh.nlabels, sh.nlabels == 0 ? "" :
+	    (sh.strings ? "s" : "u"),
+	    sh.index == REGISTRY_INDEX_HASH ? "hash" : "tree",
+	    sh.layout == REGISTRY_LAYOUT_COLUMNS ? "columns" : "rows");
+	printf("# benchmark\tseries\tns/op\tallocs/op\n");
+
+	for (i = 0; others && i < nseries; ++i) {
+		b = bench_new(&sh, series[i]);
+		for (bm = benchmarks; bm->bm_name != NULL; ++bm) {
+			want = (argc == 0);
+			for (j = 0; j < argc && !want; ++j)
+				want = (strcmp(bm->bm_name, argv[j]) == 0);
+			if (want)
+				run_benchmark(b, bm, min_ms * 1000000ULL);
+		}
+		bench_free_all(b);
+	}
+
+	if (workers)
+		run_workers();
+
+	return (0);
+}
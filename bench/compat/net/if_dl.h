@@ -0,0 +1,48 @@
+/*
+ *
+ * Copyright 2020 The University of Queensland
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/* OpenBSD's struct sockaddr_dl, which NET_RT_IFLIST names interfaces with */
+
+#if !defined(_COMPAT_NET_IF_DL_H)
+#define _COMPAT_NET_IF_DL_H
+
+#include <stdint.h>
+
+#define	AF_LINK		18
+
+struct sockaddr_dl {
+	uint8_t		sdl_len;
+	uint8_t		sdl_family;
+	uint16_t	sdl_index;
+	uint8_t		sdl_type;
+	uint8_t		sdl_nlen;
+	uint8_t		sdl_alen;
+	uint8_t		sdl_slen;
+	char		sdl_data[24];
+};
+
+#endif /* _COMPAT_NET_IF_DL_H */
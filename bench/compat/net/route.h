@@ -0,0 +1,99 @@
+/*
+ *
+ * Copyright 2020 The University of Queensland
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * OpenBSD's routing messages, as far as NET_RT_IFLIST's RTM_IFINFO (and so
+ * struct if_data, which is in net/if.h there) goes.
+ */
+
+#if !defined(_COMPAT_NET_ROUTE_H)
+#define _COMPAT_NET_ROUTE_H
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+/* the mib says 17 whatever the system calls it */
+#undef	PF_ROUTE
+#define	PF_ROUTE	17
+#define	NET_RT_IFLIST	3
+
+/*
+ * The first byte of an OpenBSD sockaddr is its length, and the system's
+ * struct sockaddr has no sa_len. On little-endian machines that byte is the
+ * bottom of sa_family.
+ */
+#define	sa_len		sa_family & 0xff
+
+#define	RTM_VERSION	5
+#define	RTM_IFINFO	0xe
+
+#define	RTA_IFP		0x10
+#define	RTAX_IFP	4
+#define	RTAX_MAX	15
+
+struct if_data {
+	uint8_t		ifi_type;
+	uint8_t		ifi_addrlen;
+	uint8_t		ifi_hdrlen;
+	uint8_t		ifi_link_state;
+	uint32_t	ifi_mtu;
+	uint32_t	ifi_metric;
+	uint32_t	ifi_rdomain;
+	uint64_t	ifi_baudrate;
+	uint64_t	ifi_ipackets;
+	uint64_t	ifi_ierrors;
+	uint64_t	ifi_opackets;
+	uint64_t	ifi_oerrors;
+	uint64_t	ifi_collisions;
+	uint64_t	ifi_ibytes;
+	uint64_t	ifi_obytes;
+	uint64_t	ifi_imcasts;
+	uint64_t	ifi_omcasts;
+	uint64_t	ifi_iqdrops;
+	uint64_t	ifi_oqdrops;
+	uint64_t	ifi_noproto;
+	uint32_t	ifi_capabilities;
+	struct timeval	ifi_lastchange;
+};
+
+struct if_msghdr {
+	uint16_t	ifm_msglen;
+	uint8_t		ifm_version;
+	uint8_t		ifm_type;
+	uint16_t	ifm_hdrlen;
+	uint16_t	ifm_index;
+	uint16_t	ifm_tableid;
+	uint8_t		ifm_pad1;
+	uint8_t		ifm_pad2;
+	int		ifm_addrs;
+	int		ifm_flags;
+	int		ifm_xflags;
+	struct if_data	ifm_data;
+};
+
+#endif /* _COMPAT_NET_ROUTE_H */
@@ -0,0 +1,52 @@
+/*
+ *
+ * Copyright 2020 The University of Queensland
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/* OpenBSD's struct diskstats, for HW_DISKSTATS (see compat/sys/sysctl.h) */
+
+#if !defined(_COMPAT_SYS_DISK_H)
+#define _COMPAT_SYS_DISK_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#define	DS_DISKNAMELEN	16
+
+struct diskstats {
+	char		ds_name[DS_DISKNAMELEN];
+	int		ds_busy;
+	uint64_t	ds_rxfer;
+	uint64_t	ds_wxfer;
+	uint64_t	ds_seek;
+	uint64_t	ds_rbytes;
+	uint64_t	ds_wbytes;
+	struct timeval	ds_attachtime;
+	struct timeval	ds_timestamp;
+	struct timeval	ds_time;
+	char		ds_duid[8];
+};
+
+#endif /* _COMPAT_SYS_DISK_H */
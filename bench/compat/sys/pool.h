@@ -0,0 +1,58 @@
+/*
+ *
+ * Copyright 2020 The University of Queensland
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/* OpenBSD's struct kinfo_pool, for KERN_POOL (see compat/sys/sysctl.h) */
+
+#if !defined(_COMPAT_SYS_POOL_H)
+#define _COMPAT_SYS_POOL_H
+
+#define	KERN_POOL_NPOOLS	1
+#define	KERN_POOL_NAME		2
+#define	KERN_POOL_POOL		3
+
+struct kinfo_pool {
+	unsigned int	pr_size;
+	unsigned int	pr_pgsize;
+	unsigned int	pr_itemsperpage;
+	unsigned int	pr_minpages;
+	unsigned int	pr_maxpages;
+	unsigned int	pr_hardlimit;
+
+	unsigned int	pr_npages;
+	unsigned int	pr_nout;
+	unsigned int	pr_nitems;
+
+	unsigned long	pr_nget;
+	unsigned long	pr_nfail;
+	unsigned long	pr_nput;
+	unsigned long	pr_npagealloc;
+	unsigned long	pr_npagefree;
+	unsigned int	pr_hiwat;
+	unsigned long	pr_nidle;
+};
+
+#endif /* _COMPAT_SYS_POOL_H */
@@ -0,0 +1,50 @@
+/*
+ *
+ * Copyright 2020 The University of Queensland
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * The parts of OpenBSD's headers which ksysctl.c and the collectors that
+ * bench/replay runs use, laid out as on amd64 so that fixtures recorded there
+ * replay the same here. Only used where the real ones aren't available.
+ */
+
+#if !defined(_COMPAT_SYS_SYSCTL_H)
+#define _COMPAT_SYS_SYSCTL_H
+
+#define	CTL_MAXNAME	12
+
+#define	CTL_KERN	1
+#define	CTL_NET		4
+#define	CTL_HW		6
+
+#define	KERN_POOL	49
+#define	KERN_CPUSTATS	85
+
+#define	HW_NCPU		3
+#define	HW_DISKSTATS	9
+#define	HW_DISKCOUNT	10
+
+#endif /* _COMPAT_SYS_SYSCTL_H */
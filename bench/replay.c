@@ -0,0 +1,221 @@
+/*
+ *
+ * Copyright 2020 The University of Queensland
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * Runs the collectors which ksysctl_replay() can scale (cpu, pools, if and
+ * disk) against a sysctl fixture, so that they build and run anywhere (see
+ * the Makefile), and checks that each of them exports a series for every
+ * CPU, pool, interface or disk it was given.
+ *
+ * Prints the best time per collection, and per render of the text format,
+ * over -n passes.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <err.h>
+
+#include "ksysctl.h"
+#include "log.h"
+#include "metrics.h"
+
+extern FILE *logfile;
+
+extern struct metrics_module_ops collect_cpu_ops, collect_pools_ops,
+    collect_if_ops, collect_disk_ops;
+
+static struct metrics_module_ops *const replay_modules[] = {
+	&collect_cpu_ops,
+	&collect_pools_ops,
+	&collect_if_ops,
+	&collect_disk_ops,
+	NULL
+};
+
+/* CPU states in cpu_time_spent_total (CPUSTATES) */
+#define	CPU_STATES	6
+
+/* The series of a metric in a text rendering: lines starting 'name{' */
+static size_t
+count_series(const struct wbuf *b, const char *name)
+{
+	const char *p = wbuf_data(b), *end = p + wbuf_len(b), *nl;
+	size_t n = 0, len = strlen(name);
+
+	for (; p < end; p = nl + 1) {
+		nl = memchr(p, '\n', end - p);
+		if (nl == NULL)
+			nl = end;
+		if ((size_t)(nl - p) > len && strncmp(p, name, len) == 0 &&
+		    p[len] == '{')
+			++n;
+	}
+	return (n);
+}
+
+static int
+check(const struct wbuf *b, const char *name, size_t want)
+{
+	size_t n;
+
+	/* not scaled: whatever was recorded */
+	if (want == 0)
+		return (0);
+	n = count_series(b, name);
+	if (n == want)
+		return (0);
+	fprintf(stderr, "%s: %zu series, wanted %zu\n", name, n, want);
+	return (1);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static u_int
+parse_count(int c, const char *arg)
+{
+	unsigned long v;
+	char *p;
+
+	errno = 0;
+	v = strtoul(arg, &p, 0);
+	if (errno != 0 || *p != '\0' || v > 100000)
+		errx(EXIT_USAGE, "invalid argument for -%c: '%s'", c, arg);
+	return (v);
+}
+
+static void
+usage(const char *arg0)
+{
+	fprintf(stderr, "usage: %s [-C] [-c cpus] [-d disks] [-i ifs] "
+	    "[-n passes] [-p pools] fixture\n", arg0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *optstring = "Cc:d:i:n:p:";
+	struct ksysctl_scale scale;
+	struct registry *r;
+	struct wbuf *b;
+	FILE *f;
+	uint64_t start, t, best_collect = 0, best_render = 0;
+	u_int passes = 5, i;
+	int c, rc, columns = 0, bad = 0;
+
+	logfile = stderr;
+	bzero(&scale, sizeof (scale));
+
+	while ((c = getopt(argc, argv, optstring)) != -1) {
+		switch (c) {
+		case 'C':
+			columns = 1;
+			break;
+		case 'c':
+			scale.ks_cpus = parse_count(c, optarg);
+			break;
+		case 'd':
+			scale.ks_disks = parse_count(c, optarg);
+			break;
+		case 'i':
+			scale.ks_ifs = parse_count(c, optarg);
+			break;
+		case 'n':
+			passes = parse_count(c, optarg);
+			if (passes == 0)
+				errx(EXIT_USAGE, "-n must be at least 1");
+			break;
+		case 'p':
+			scale.ks_pools = parse_count(c, optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return (EXIT_USAGE);
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return (EXIT_USAGE);
+	}
+
+	f = fopen(argv[optind], "r");
+	if (f == NULL)
+		err(EXIT_USAGE, "open('%s')", argv[optind]);
+	rc = ksysctl_replay(f, &scale);
+	if (rc != 0)
+		errc(EXIT_USAGE, rc, "'%s'", argv[optind]);
+	fclose(f);
+
+	r = registry_build(replay_modules);
+	if (columns)
+		registry_set_layout(r, REGISTRY_LAYOUT_COLUMNS);
+	b = wbuf_new(0);
+
+	for (i = 0; i < passes; ++i) {
+		start = now_ns();
+		registry_collect(r);
+		t = now_ns() - start;
+		if (i == 0 || t < best_collect)
+			best_collect = t;
+
+		wbuf_reset(b);
+		start = now_ns();
+		print_registry(b, r);
+		t = now_ns() - start;
+		if (i == 0 || t < best_render)
+			best_render = t;
+	}
+
+	bad |= check(b, "cpu_time_spent_total", scale.ks_cpus * CPU_STATES);
+	bad |= check(b, "pool_items", scale.ks_pools);
+	bad |= check(b, "net_bytes_in_total", scale.ks_ifs);
+	bad |= check(b, "io_device_read_ops_total", scale.ks_disks);
+
+	printf("# cpus=%u pools=%u ifs=%u disks=%u layout=%s\n",
+	    scale.ks_cpus, scale.ks_pools, scale.ks_ifs, scale.ks_disks,
+	    columns ? "columns" : "rows");
+	printf("collect\t%.3f ms\n", best_collect / 1e6);
+	printf("render_text\t%.3f ms\t%zu bytes\n", best_render / 1e6,
+	    wbuf_len(b));
+
+	wbuf_free(b);
+	registry_free(r);
+
+	return (bad ? EXIT_ERROR : 0);
+}
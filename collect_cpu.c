@@ -38,12 +38,28 @@
 #include <sys/signal.h>
 #include <sys/sched.h>
 
+#include "ksysctl.h"
 #include "metrics.h"
 #include "log.h"
 
+static const char *cpu_state_names[CPUSTATES] = {
+	[CP_USER] = "user",
+	[CP_NICE] = "nice",
+	[CP_SYS] = "sys",
+	[CP_SPIN] = "spin",
+	[CP_INTR] = "intr",
+	[CP_IDLE] = "idle"
+};
+
 struct cpu_modpriv {
 	struct metric *cpu_time;
 	int cpu_count;
+	/* cpu_count * CPUSTATES handles, indexed by cpu then state */
+	struct metric_val **cpu_time_vals;
+	/* cs_time from cpu_sample(), keyed and indexed like cpu_time_vals */
+	struct burst *burst;
+	struct metric *cpu_burst;
+	struct metric_val **cpu_burst_vals;
 };
 
 struct metric_ops cpu_metric_ops = {
@@ -57,13 +73,15 @@ cpu_register(struct registry *r, void **modpriv)
 	struct cpu_modpriv *priv;
 	int mib[] = { CTL_HW, HW_NCPU };
 	size_t size;
+	uint64_t i;
+	int j;
 
 	priv = calloc(1, sizeof (struct cpu_modpriv));
 
 	*modpriv = priv;
 
 	size = sizeof(priv->cpu_count);
-	if (sysctl(mib, 2, &priv->cpu_count, &size, NULL, 0) == -1)
+	if (ksysctl(mib, 2, &priv->cpu_count, &size) == -1)
 		err(1, "%s: cpu count", __func__);
 
 	priv->cpu_time = metric_new(r, "cpu_time_spent_total",
@@ -72,45 +90,113 @@ cpu_register(struct registry *r, void **modpriv)
 	    metric_label_new("cpu", METRIC_VAL_UINT64),
 	    metric_label_new("state", METRIC_VAL_STRING),
 	    NULL);
+	metric_track_rate(priv->cpu_time, "cpu_time_spent_per_second",
+	    "Rate of time spent in different CPU states, in ticks per second",
+	    METRIC_RATE_SAMPLES);
+
+	priv->cpu_burst = metric_new_burst(r, "cpu_time_spent_burst",
+	    "Time spent in different CPU states per sample interval, "
+	    "since the last collection",
+	    NULL, &cpu_metric_ops,
+	    metric_label_new("cpu", METRIC_VAL_UINT64),
+	    metric_label_new("state", METRIC_VAL_STRING),
+	    NULL);
+	priv->burst = burst_new();
+
+	priv->cpu_time_vals = calloc(priv->cpu_count * CPUSTATES,
+	    sizeof (struct metric_val *));
+	priv->cpu_burst_vals = calloc(priv->cpu_count * CPUSTATES,
+	    sizeof (struct metric_val *));
+	if (priv->cpu_time_vals == NULL || priv->cpu_burst_vals == NULL)
+		tserr(EXIT_MEMORY, "calloc");
+	for (i = 0; i < priv->cpu_count; i++) {
+		for (j = 0; j < CPUSTATES; j++) {
+			priv->cpu_time_vals[i * CPUSTATES + j] = metric_val_get(
+			    priv->cpu_time, i, cpu_state_names[j]);
+		}
+	}
 }
 
 static int
 cpu_collect(void *modpriv)
 {
 	struct cpu_modpriv *priv = modpriv;
+	struct metric_val **vals;
 	uint64_t i;
+	int j;
 
 	for (i = 0; i < priv->cpu_count; i++) {
 		int mib[3] = { CTL_KERN, KERN_CPUSTATS, i };
 		struct cpustats cs;
 		size_t size = sizeof(cs);
 
-		if (sysctl(mib, 3, &cs, &size, NULL, 0) == -1) {
+		if (ksysctl(mib, 3, &cs, &size) == -1) {
 			tslog("failed to get cpu%" PRIu64 " stats: %s", i,
 			    strerror(errno));
 			continue;
 		}
 
-		metric_update(priv->cpu_time, i, "user", cs.cs_time[CP_USER]);
-		metric_update(priv->cpu_time, i, "nice", cs.cs_time[CP_NICE]);
-		metric_update(priv->cpu_time, i, "sys", cs.cs_time[CP_SYS]);
-		metric_update(priv->cpu_time, i, "spin", cs.cs_time[CP_SPIN]);
-		metric_update(priv->cpu_time, i, "intr", cs.cs_time[CP_INTR]);
-		metric_update(priv->cpu_time, i, "idle", cs.cs_time[CP_IDLE]);
+		vals = &priv->cpu_time_vals[i * CPUSTATES];
+		for (j = 0; j < CPUSTATES; j++)
+			metric_val_set_uint64(vals[j], cs.cs_time[j]);
+	}
+
+	/* values for the bursts only appear once the sampler has run */
+	for (i = 0; i < priv->cpu_count * CPUSTATES; i++) {
+		if (!burst_sampled(priv->burst, i))
+			continue;
+		vals = &priv->cpu_burst_vals[i];
+		if (*vals == NULL) {
+			*vals = metric_val_get(priv->cpu_burst, i / CPUSTATES,
+			    cpu_state_names[i % CPUSTATES]);
+		}
+		burst_flush(priv->burst, i, *vals);
 	}
 
 	return (0);
 }
 
+static void
+cpu_sample(void *modpriv)
+{
+	struct cpu_modpriv *priv = modpriv;
+	uint64_t i;
+	int j;
+
+	for (i = 0; i < priv->cpu_count; i++) {
+		int mib[3] = { CTL_KERN, KERN_CPUSTATS, i };
+		struct cpustats cs;
+		size_t size = sizeof(cs);
+
+		if (ksysctl(mib, 3, &cs, &size) == -1)
+			continue;
+		for (j = 0; j < CPUSTATES; j++) {
+			burst_sample(priv->burst, i * CPUSTATES + j,
+			    cs.cs_time[j]);
+		}
+	}
+}
+
 static void
 cpu_free(void *modpriv)
 {
 	struct cpu_modpriv *priv = modpriv;
+	size_t i;
+
+	for (i = 0; i < priv->cpu_count * CPUSTATES; i++) {
+		metric_val_release(priv->cpu_time_vals[i]);
+		metric_val_release(priv->cpu_burst_vals[i]);
+	}
+	free(priv->cpu_time_vals);
+	free(priv->cpu_burst_vals);
+	burst_free(priv->burst);
 	free(priv);
 }
 
 struct metrics_module_ops collect_cpu_ops = {
+	.mm_name = "cpu",
 	.mm_register = cpu_register,
 	.mm_collect = cpu_collect,
+	.mm_sample = cpu_sample,
 	.mm_free = cpu_free
 };
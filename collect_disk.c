@@ -34,14 +34,24 @@
 #include <sys/sysctl.h>
 #include <sys/disk.h>
 
+#include "ksysctl.h"
 #include "metrics.h"
 #include "log.h"
 
+/* Cached metric_val handles for one disk, by index in hw.diskstats. */
+struct disk_entry {
+	char name[DS_DISKNAMELEN];
+	struct metric_val *rops, *wops, *rbytes, *wbytes;
+	struct metric_val *rtime;
+};
+
 struct disk_modpriv {
 	struct diskstats *stats;
 	size_t zstats;
 	struct metric *rops, *wops, *rbytes, *wbytes;
 	struct metric *rtime;
+	struct disk_entry *disks;
+	int ndisks;
 };
 
 struct metric_ops disk_metric_ops = {
@@ -84,6 +94,9 @@ disk_register(struct registry *r, void **modpriv)
 	    METRIC_COUNTER, METRIC_VAL_UINT64, NULL, &disk_metric_ops,
 	    metric_label_new("device", METRIC_VAL_STRING),
 	    NULL);
+	metric_track_rate(priv->rtime, "io_device_busy_nsec_per_second",
+	    "IO device busy (service) time in nanoseconds per second",
+	    METRIC_RATE_SAMPLES);
 
 	priv->zstats = 16 * sizeof (struct diskstats);
 	priv->stats = malloc(priv->zstats);
@@ -95,6 +108,37 @@ disk_register(struct registry *r, void **modpriv)
 	}
 }
 
+static void
+disk_entry_release(struct disk_entry *de)
+{
+	metric_val_release(de->rops);
+	metric_val_release(de->wops);
+	metric_val_release(de->rbytes);
+	metric_val_release(de->wbytes);
+	metric_val_release(de->rtime);
+	bzero(de, sizeof (*de));
+}
+
+static struct disk_entry *
+disk_entry_get(struct disk_modpriv *priv, int i, const char *name)
+{
+	struct disk_entry *de = &priv->disks[i];
+
+	if (de->rops != NULL && strcmp(de->name, name) == 0)
+		return (de);
+
+	disk_entry_release(de);
+	strlcpy(de->name, name, sizeof (de->name));
+
+	de->rops = metric_val_get(priv->rops, name);
+	de->wops = metric_val_get(priv->wops, name);
+	de->rbytes = metric_val_get(priv->rbytes, name);
+	de->wbytes = metric_val_get(priv->wbytes, name);
+	de->rtime = metric_val_get(priv->rtime, name);
+
+	return (de);
+}
+
 static int
 disk_collect(void *modpriv)
 {
@@ -102,9 +146,10 @@ disk_collect(void *modpriv)
 	size_t size;
 	int i, n;
 	int mib[] = { CTL_HW, HW_DISKCOUNT };
+	struct disk_entry *de;
 
 	size = sizeof (int);
-	if (sysctl(mib, 2, &n, &size, NULL, 0) == -1) {
+	if (ksysctl(mib, 2, &n, &size) == -1) {
 		tslog("failed to get stats: %s", strerror(errno));
 		return (0);
 	}
@@ -123,34 +168,40 @@ disk_collect(void *modpriv)
 	bzero(priv->stats, size);
 
 	mib[1] = HW_DISKSTATS;
-	if (sysctl(mib, 2, priv->stats, &size, NULL, 0) == -1) {
+	if (ksysctl(mib, 2, priv->stats, &size) == -1) {
 		tslog("failed to get stats: %s", strerror(errno));
 		return (0);
 	}
 
+	if (n > priv->ndisks) {
+		de = recallocarray(priv->disks, priv->ndisks, n,
+		    sizeof (struct disk_entry));
+		if (de == NULL) {
+			tslog("failed to expand disk cache: %s",
+			    strerror(errno));
+			return (0);
+		}
+		priv->disks = de;
+		priv->ndisks = n;
+	}
+	for (i = n; i < priv->ndisks; ++i)
+		disk_entry_release(&priv->disks[i]);
+
 	for (i = 0; i < n; ++i) {
 		uint64_t t;
 
-		metric_update(priv->rops, priv->stats[i].ds_name,
-		    priv->stats[i].ds_rxfer);
-		metric_update(priv->wops, priv->stats[i].ds_name,
-		    priv->stats[i].ds_wxfer);
-		metric_update(priv->rbytes, priv->stats[i].ds_name,
-		    priv->stats[i].ds_rbytes);
-		metric_update(priv->wbytes, priv->stats[i].ds_name,
-		    priv->stats[i].ds_wbytes);
+		de = disk_entry_get(priv, i, priv->stats[i].ds_name);
+
+		metric_val_set_uint64(de->rops, priv->stats[i].ds_rxfer);
+		metric_val_set_uint64(de->wops, priv->stats[i].ds_wxfer);
+		metric_val_set_uint64(de->rbytes, priv->stats[i].ds_rbytes);
+		metric_val_set_uint64(de->wbytes, priv->stats[i].ds_wbytes);
 
 		t = priv->stats[i].ds_time.tv_usec * 1000ULL;
 		t += priv->stats[i].ds_time.tv_sec * 1000000000ULL;
-		metric_update(priv->rtime, priv->stats[i].ds_name, t);
+		metric_val_set_uint64(de->rtime, t);
 	}
 
-	metric_clear_old_values(priv->rops);
-	metric_clear_old_values(priv->wops);
-	metric_clear_old_values(priv->rbytes);
-	metric_clear_old_values(priv->wbytes);
-	metric_clear_old_values(priv->rtime);
-
 	return (0);
 }
 
@@ -158,11 +209,17 @@ static void
 disk_free(void *modpriv)
 {
 	struct disk_modpriv *priv = modpriv;
+	int i;
+
+	for (i = 0; i < priv->ndisks; ++i)
+		disk_entry_release(&priv->disks[i]);
+	free(priv->disks);
 	free(priv->stats);
 	free(priv);
 }
 
 struct metrics_module_ops collect_disk_ops = {
+	.mm_name = "disk",
 	.mm_register = disk_register,
 	.mm_collect = disk_collect,
 	.mm_free = disk_free
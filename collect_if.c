@@ -41,17 +41,105 @@
 #include <net/route.h>
 #include <sys/sockio.h>
 #include <sys/ioctl.h>
+#include <sys/tree.h>
 
+#include "ksysctl.h"
 #include "metrics.h"
 #include "log.h"
 
+/*
+ * Counters which if_sample() looks at, for bursts. Each is keyed by the
+ * interface index times IF_BURSTS plus its position here.
+ */
+enum if_burst {
+	IF_BURST_IBYTES,
+	IF_BURST_OBYTES,
+	IF_BURST_IQDROPS,
+	IF_BURST_OQDROPS,
+	IF_BURSTS
+};
+
+enum if_metric {
+	IF_IPACKETS,
+	IF_IBYTES,
+	IF_IERRORS,
+	IF_IQDROPS,
+	IF_OPACKETS,
+	IF_OBYTES,
+	IF_OERRORS,
+	IF_OQDROPS,
+	IF_NMETRICS
+};
+
+static const struct metric_label_desc if_labels[] = {
+	{ "interface", METRIC_VAL_STRING }
+};
+
+#define	IF_COUNTER(_name, _help) {					\
+	.md_name = (_name), .md_help = (_help), .md_type = METRIC_COUNTER, \
+	.md_val_type = METRIC_VAL_UINT64, .md_labels = if_labels,	\
+	.md_nlabels = 1 }
+
+static const struct metric_desc if_metrics[IF_NMETRICS] = {
+	[IF_IPACKETS] = IF_COUNTER("net_packets_in_total",
+	    "Number of input packets received"),
+	[IF_IBYTES] = IF_COUNTER("net_bytes_in_total",
+	    "Number of input bytes received"),
+	[IF_IERRORS] = IF_COUNTER("net_errors_in_total",
+	    "Number of input errors encountered"),
+	[IF_IQDROPS] = IF_COUNTER("net_qdrops_in_total",
+	    "Number of input queue drops encountered"),
+
+	[IF_OPACKETS] = IF_COUNTER("net_packets_out_total",
+	    "Number of output packets sent"),
+	[IF_OBYTES] = IF_COUNTER("net_bytes_out_total",
+	    "Number of output bytes sent"),
+	[IF_OERRORS] = IF_COUNTER("net_errors_out_total",
+	    "Number of output errors encountered"),
+	[IF_OQDROPS] = IF_COUNTER("net_qdrops_out_total",
+	    "Number of output queue drops encountered")
+};
+
+/* Cached metric_val handles for one interface, by interface index. */
+struct if_entry {
+	RB_ENTRY(if_entry) entry;
+	u_short index;
+	char name[IFNAMSIZ];
+	/* if_modpriv gen when this interface was last seen */
+	uint64_t gen;
+	struct metric_val *vals[IF_NMETRICS];
+	/* created once the sampler has something for them */
+	struct metric_val *bursts[IF_BURSTS];
+};
+
+RB_HEAD(iftree, if_entry);
+
 struct if_modpriv {
 	char *buf;
 	size_t bsize;
-	struct metric *ipackets, *ibytes, *ierrors, *iqdrops;
-	struct metric *opackets, *obytes, *oerrors, *oqdrops;
+	struct metric *metrics[IF_NMETRICS];
+	struct iftree ifs;
+	uint64_t gen;
+
+	struct burst *burst;
+	struct metric *bursts[IF_BURSTS];
+	/* if_sample()'s own copy of buf */
+	char *sbuf;
+	size_t sbsize;
 };
 
+static int
+if_entry_cmp(const struct if_entry *a, const struct if_entry *b)
+{
+	if (a->index < b->index)
+		return (-1);
+	if (a->index > b->index)
+		return (1);
+	return (0);
+}
+
+RB_GENERATE_STATIC(iftree, if_entry, entry, if_entry_cmp);
+
 struct metric_ops if_metric_ops = {
 	.mo_collect = NULL,
 	.mo_free = NULL
@@ -64,51 +152,49 @@ if_register(struct registry *r, void **modpriv)
 
 	priv = calloc(1, sizeof (struct if_modpriv));
 	*modpriv = priv;
+	RB_INIT(&priv->ifs);
 
 	priv->bsize = 64*1024;
 	priv->buf = malloc(priv->bsize);
 	if (priv->buf == NULL)
 		tserr(EXIT_MEMORY, "malloc");
 
-	priv->ipackets = metric_new(r, "net_packets_in_total",
-	    "Number of input packets received",
-	    METRIC_COUNTER, METRIC_VAL_UINT64, NULL, &if_metric_ops,
-	    metric_label_new("interface", METRIC_VAL_STRING),
-	    NULL);
-	priv->ibytes = metric_new(r, "net_bytes_in_total",
-	    "Number of input bytes received",
-	    METRIC_COUNTER, METRIC_VAL_UINT64, NULL, &if_metric_ops,
-	    metric_label_new("interface", METRIC_VAL_STRING),
-	    NULL);
-	priv->ierrors = metric_new(r, "net_errors_in_total",
-	    "Number of input errors encountered",
-	    METRIC_COUNTER, METRIC_VAL_UINT64, NULL, &if_metric_ops,
-	    metric_label_new("interface", METRIC_VAL_STRING),
-	    NULL);
-	priv->iqdrops = metric_new(r, "net_qdrops_in_total",
-	    "Number of input queue drops encountered",
-	    METRIC_COUNTER, METRIC_VAL_UINT64, NULL, &if_metric_ops,
-	    metric_label_new("interface", METRIC_VAL_STRING),
-	    NULL);
+	metric_new_table(r, if_metrics, IF_NMETRICS, NULL, &if_metric_ops,
+	    priv->metrics);
+	metric_track_rate(priv->metrics[IF_IBYTES], "net_bytes_in_per_second",
+	    "Number of input bytes received per second",
+	    METRIC_RATE_SAMPLES);
+	metric_track_rate(priv->metrics[IF_OBYTES], "net_bytes_out_per_second",
+	    "Number of output bytes sent per second",
+	    METRIC_RATE_SAMPLES);
 
-	priv->opackets = metric_new(r, "net_packets_out_total",
-	    "Number of output packets sent",
-	    METRIC_COUNTER, METRIC_VAL_UINT64, NULL, &if_metric_ops,
+	priv->burst = burst_new();
+	priv->bursts[IF_BURST_IBYTES] = metric_new_burst(r,
+	    "net_bytes_in_burst",
+	    "Number of input bytes received per sample interval, since the "
+	    "last collection",
+	    NULL, &if_metric_ops,
 	    metric_label_new("interface", METRIC_VAL_STRING),
 	    NULL);
-	priv->obytes = metric_new(r, "net_bytes_out_total",
-	    "Number of output bytes sent",
-	    METRIC_COUNTER, METRIC_VAL_UINT64, NULL, &if_metric_ops,
+	priv->bursts[IF_BURST_OBYTES] = metric_new_burst(r,
+	    "net_bytes_out_burst",
+	    "Number of output bytes sent per sample interval, since the "
+	    "last collection",
+	    NULL, &if_metric_ops,
 	    metric_label_new("interface", METRIC_VAL_STRING),
 	    NULL);
-	priv->oerrors = metric_new(r, "net_errors_out_total",
-	    "Number of output errors encountered",
-	    METRIC_COUNTER, METRIC_VAL_UINT64, NULL, &if_metric_ops,
+	priv->bursts[IF_BURST_IQDROPS] = metric_new_burst(r,
+	    "net_qdrops_in_burst",
+	    "Number of input queue drops per sample interval, since the "
+	    "last collection",
+	    NULL, &if_metric_ops,
 	    metric_label_new("interface", METRIC_VAL_STRING),
 	    NULL);
-	priv->oqdrops = metric_new(r, "net_qdrops_out_total",
-	    "Number of output queue drops encountered",
-	    METRIC_COUNTER, METRIC_VAL_UINT64, NULL, &if_metric_ops,
+	priv->bursts[IF_BURST_OQDROPS] = metric_new_burst(r,
+	    "net_qdrops_out_burst",
+	    "Number of output queue drops per sample interval, since the "
+	    "last collection",
+	    NULL, &if_metric_ops,
 	    metric_label_new("interface", METRIC_VAL_STRING),
 	    NULL);
 }
@@ -128,6 +214,77 @@ rt_getaddrinfo(struct sockaddr *sa, int addrs, struct sockaddr **info)
 	}
 }
 
+static void
+if_entry_release(struct if_entry *ie)
+{
+	metric_val_release_table(ie->bursts, IF_BURSTS);
+	metric_val_release_table(ie->vals, IF_NMETRICS);
+}
+
+static void
+if_burst_forget(struct if_modpriv *priv, u_short index)
+{
+	int i;
+
+	for (i = 0; i < IF_BURSTS; ++i)
+		burst_forget(priv->burst, index * IF_BURSTS + i);
+}
+
+static struct if_entry *
+if_entry_get(struct if_modpriv *priv, u_short index, const char *name)
+{
+	struct if_entry key, *ie;
+	union metric_label_val lv = { .mlv_string = name };
+
+	key.index = index;
+	ie = RB_FIND(iftree, &priv->ifs, &key);
+	if (ie != NULL && strcmp(ie->name, name) == 0)
+		return (ie);
+
+	if (ie != NULL) {
+		/* index has been re-used by a new interface */
+		if_entry_release(ie);
+		if_burst_forget(priv, index);
+	} else {
+		ie = calloc(1, sizeof (struct if_entry));
+		if (ie == NULL)
+			tserr(EXIT_MEMORY, "calloc");
+		ie->index = index;
+		RB_INSERT(iftree, &priv->ifs, ie);
+	}
+	strlcpy(ie->name, name, sizeof (ie->name));
+
+	metric_val_get_table(priv->metrics, IF_NMETRICS, &lv, ie->vals);
+
+	return (ie);
+}
+
+/*
+ * Reads the interface list into *bufp, growing it if need be. Returns the
+ * length, or 0 with errno set.
+ */
+static size_t
+if_fetch(char **bufp, size_t *bsizep)
+{
+	int mib[6] = { CTL_NET, PF_ROUTE, 0, 0, NET_RT_IFLIST, 0 };
+	size_t need;
+	char *newbuf;
+
+	if (ksysctl(mib, 6, NULL, &need) == -1)
+		return (0);
+	if (need > *bsizep) {
+		newbuf = malloc(need);
+		if (newbuf == NULL)
+			return (0);
+		*bsizep = need;
+		free(*bufp);
+		*bufp = newbuf;
+	}
+	if (ksysctl(mib, 6, *bufp, &need) == -1)
+		return (0);
+	return (need);
+}
+
 static int
 if_collect(void *modpriv)
 {
@@ -135,32 +292,20 @@ if_collect(void *modpriv)
 	size_t need;
 	struct if_msghdr ifm;
 	char *buf, *lim, *next;
-	int mib[6] = { CTL_NET, PF_ROUTE, 0, 0, NET_RT_IFLIST, 0 };
 	struct sockaddr *info[RTAX_MAX];
 	struct sockaddr_dl *sdl;
+	struct if_entry *ie, *nie;
+	uint64_t v[IF_NMETRICS];
+	int i;
 
-	buf = priv->buf;
-
-	if (sysctl(mib, 6, NULL, &need, NULL, 0) == -1) {
-		tslog("failed to get if stats: %s", strerror(errno));
-		return (0);
-	}
-	if (need > priv->bsize) {
-		char *newbuf = malloc(need);
-		if (newbuf == NULL) {
-			tslog("failed to expand if buffer: %s",
-				strerror(errno));
-			return (0);
-		}
-		priv->bsize = need;
-		free(priv->buf);
-		priv->buf = newbuf;
-	}
-	if (sysctl(mib, 6, buf, &need, NULL, 0) == -1) {
+	need = if_fetch(&priv->buf, &priv->bsize);
+	if (need == 0) {
 		tslog("failed to get if stats: %s", strerror(errno));
 		return (0);
 	}
+	buf = priv->buf;
 
+	++priv->gen;
 	lim = buf + need;
 	for (next = buf; next < lim; next += ifm.ifm_msglen) {
 		bcopy(next, &ifm, sizeof ifm);
@@ -181,48 +326,98 @@ if_collect(void *modpriv)
 			bcopy(sdl->sdl_data, name, sdl->sdl_nlen);
 			name[sdl->sdl_nlen] = '\0';
 
-			metric_update(priv->ipackets, name,
-			    ifm.ifm_data.ifi_ipackets);
-			metric_update(priv->ibytes, name,
-			    ifm.ifm_data.ifi_ibytes);
-			metric_update(priv->ierrors, name,
-			    ifm.ifm_data.ifi_ierrors);
-			metric_update(priv->iqdrops, name,
-			    ifm.ifm_data.ifi_iqdrops);
-
-			metric_update(priv->opackets, name,
-			    ifm.ifm_data.ifi_opackets);
-			metric_update(priv->obytes, name,
-			    ifm.ifm_data.ifi_obytes);
-			metric_update(priv->oerrors, name,
-			    ifm.ifm_data.ifi_oerrors);
-			metric_update(priv->oqdrops, name,
-			    ifm.ifm_data.ifi_oqdrops);
+			ie = if_entry_get(priv, ifm.ifm_index, name);
+			ie->gen = priv->gen;
+
+			v[IF_IPACKETS] = ifm.ifm_data.ifi_ipackets;
+			v[IF_IBYTES] = ifm.ifm_data.ifi_ibytes;
+			v[IF_IERRORS] = ifm.ifm_data.ifi_ierrors;
+			v[IF_IQDROPS] = ifm.ifm_data.ifi_iqdrops;
+			v[IF_OPACKETS] = ifm.ifm_data.ifi_opackets;
+			v[IF_OBYTES] = ifm.ifm_data.ifi_obytes;
+			v[IF_OERRORS] = ifm.ifm_data.ifi_oerrors;
+			v[IF_OQDROPS] = ifm.ifm_data.ifi_oqdrops;
+			metric_vals_set_uint64(ie->vals, v, IF_NMETRICS);
+
+			for (i = 0; i < IF_BURSTS; ++i) {
+				uint64_t key = ie->index * IF_BURSTS + i;
+
+				if (!burst_sampled(priv->burst, key))
+					continue;
+				if (ie->bursts[i] == NULL) {
+					ie->bursts[i] = metric_val_get(
+					    priv->bursts[i], name);
+				}
+				burst_flush(priv->burst, key, ie->bursts[i]);
+			}
 		}
 	}
 
-	metric_clear_old_values(priv->ipackets);
-	metric_clear_old_values(priv->ibytes);
-	metric_clear_old_values(priv->ierrors);
-	metric_clear_old_values(priv->iqdrops);
-	metric_clear_old_values(priv->opackets);
-	metric_clear_old_values(priv->obytes);
-	metric_clear_old_values(priv->oerrors);
-	metric_clear_old_values(priv->oqdrops);
+	/* forget about interfaces which have gone away */
+	RB_FOREACH_SAFE(ie, iftree, &priv->ifs, nie) {
+		if (ie->gen == priv->gen)
+			continue;
+		RB_REMOVE(iftree, &priv->ifs, ie);
+		if_entry_release(ie);
+		if_burst_forget(priv, ie->index);
+		free(ie);
+	}
 
 	return (0);
 }
 
+static void
+if_sample(void *modpriv)
+{
+	struct if_modpriv *priv = modpriv;
+	struct if_msghdr ifm;
+	char *lim, *next;
+	uint64_t key;
+	size_t need;
+
+	need = if_fetch(&priv->sbuf, &priv->sbsize);
+	if (need == 0)
+		return;
+
+	lim = priv->sbuf + need;
+	for (next = priv->sbuf; next < lim; next += ifm.ifm_msglen) {
+		bcopy(next, &ifm, sizeof ifm);
+		if (ifm.ifm_version != RTM_VERSION ||
+		    ifm.ifm_type != RTM_IFINFO)
+			continue;
+		key = ifm.ifm_index * IF_BURSTS;
+		burst_sample(priv->burst, key + IF_BURST_IBYTES,
+		    ifm.ifm_data.ifi_ibytes);
+		burst_sample(priv->burst, key + IF_BURST_OBYTES,
+		    ifm.ifm_data.ifi_obytes);
+		burst_sample(priv->burst, key + IF_BURST_IQDROPS,
+		    ifm.ifm_data.ifi_iqdrops);
+		burst_sample(priv->burst, key + IF_BURST_OQDROPS,
+		    ifm.ifm_data.ifi_oqdrops);
+	}
+}
+
 static void
 if_free(void *modpriv)
 {
 	struct if_modpriv *priv = modpriv;
+	struct if_entry *ie, *nie;
+
+	RB_FOREACH_SAFE(ie, iftree, &priv->ifs, nie) {
+		RB_REMOVE(iftree, &priv->ifs, ie);
+		if_entry_release(ie);
+		free(ie);
+	}
+	burst_free(priv->burst);
 	free(priv->buf);
+	free(priv->sbuf);
 	free(priv);
 }
 
 struct metrics_module_ops collect_if_ops = {
+	.mm_name = "if",
 	.mm_register = if_register,
 	.mm_collect = if_collect,
+	.mm_sample = if_sample,
 	.mm_free = if_free
 };
@@ -38,6 +38,7 @@
 #include <sys/ioctl.h>
 #include <net/pfvar.h>
 
+#include "ksysctl.h"
 #include "metrics.h"
 #include "log.h"
 
@@ -58,6 +59,25 @@ struct pf_modpriv {
 	struct metric *pf_overload_flushes;
 
 	struct metric *pf_drops;
+
+	struct metric_val *pf_running_val, *pf_states_val, *pf_src_nodes_val;
+	struct metric_val *pf_state_limit_val;
+	struct metric_val *pf_overloads_val, *pf_overload_flushes_val;
+	struct metric_val *pf_state_ops_vals[3];
+	struct metric_val *pf_src_node_ops_vals[3];
+	struct metric_val *pf_src_limits_vals[4];
+	struct metric_val *pf_drops_vals[PFRES_MAX];
+
+	/* drop counters from pf_sample(), keyed by reason */
+	struct burst *burst;
+	struct metric *pf_drops_burst;
+	struct metric_val *pf_drops_burst_vals[PFRES_MAX];
+	const char *drop_names[PFRES_MAX];
+};
+
+static const char *pf_op_names[3] = { "search", "insert", "remove" };
+static const char *pf_src_limit_names[4] = {
+	"max-src-states", "max-src-nodes", "max-src-conn", "max-src-conn-rate"
 };
 
 struct metric_ops pf_metric_ops = {
@@ -69,6 +89,8 @@ static void
 pf_register(struct registry *r, void **modpriv)
 {
 	struct pf_modpriv *priv;
+	const char *drop_names[] = PFRES_NAMES;
+	size_t i;
 
 	priv = calloc(1, sizeof (struct pf_modpriv));
 	*modpriv = priv;
@@ -113,6 +135,36 @@ pf_register(struct registry *r, void **modpriv)
 	    "pf-related reasons",
 	    METRIC_COUNTER, METRIC_VAL_UINT64, NULL, &pf_metric_ops,
 	    metric_label_new("reason", METRIC_VAL_STRING), NULL);
+
+	priv->pf_drops_burst = metric_new_burst(r, "pf_drops_burst",
+	    "Number of packets dropped by pf per sample interval, since the "
+	    "last collection",
+	    NULL, &pf_metric_ops,
+	    metric_label_new("reason", METRIC_VAL_STRING), NULL);
+	priv->burst = burst_new();
+
+	priv->pf_running_val = metric_val_get(priv->pf_running);
+	priv->pf_states_val = metric_val_get(priv->pf_states);
+	priv->pf_src_nodes_val = metric_val_get(priv->pf_src_nodes);
+	priv->pf_state_limit_val = metric_val_get(priv->pf_state_limit);
+	priv->pf_overloads_val = metric_val_get(priv->pf_overloads);
+	priv->pf_overload_flushes_val =
+	    metric_val_get(priv->pf_overload_flushes);
+	for (i = 0; i < 3; ++i) {
+		priv->pf_state_ops_vals[i] = metric_val_get(priv->pf_state_ops,
+		    pf_op_names[i]);
+		priv->pf_src_node_ops_vals[i] = metric_val_get(
+		    priv->pf_src_node_ops, pf_op_names[i]);
+	}
+	for (i = 0; i < 4; ++i) {
+		priv->pf_src_limits_vals[i] = metric_val_get(
+		    priv->pf_src_limits, pf_src_limit_names[i]);
+	}
+	for (i = 0; drop_names[i] != NULL && i < PFRES_MAX; ++i) {
+		priv->pf_drops_vals[i] = metric_val_get(priv->pf_drops,
+		    drop_names[i]);
+		priv->drop_names[i] = drop_names[i];
+	}
 }
 
 static int
@@ -121,66 +173,111 @@ pf_collect(void *modpriv)
 	struct pf_modpriv *priv = modpriv;
 	size_t size = sizeof (priv->status);
 	int mib[3] = { CTL_KERN, KERN_PFSTATUS };
-	const char *drop_names[] = PFRES_NAMES;
 	size_t i;
 
-	if (sysctl(mib, 2, &priv->status, &size, NULL, 0) == -1) {
+	if (ksysctl(mib, 2, &priv->status, &size) == -1) {
 		tslog("failed to get pf status: %s", strerror(errno));
 		return (0);
 	}
 
-	metric_update(priv->pf_running, priv->status.running);
+	metric_val_set_uint64(priv->pf_running_val, priv->status.running);
 
-	metric_update(priv->pf_states, priv->status.states);
-	metric_update(priv->pf_state_ops, "search",
+	metric_val_set_uint64(priv->pf_states_val, priv->status.states);
+	metric_val_set_uint64(priv->pf_state_ops_vals[0],
 	    priv->status.fcounters[FCNT_STATE_SEARCH]);
-	metric_update(priv->pf_state_ops, "insert",
+	metric_val_set_uint64(priv->pf_state_ops_vals[1],
 	    priv->status.fcounters[FCNT_STATE_INSERT]);
-	metric_update(priv->pf_state_ops, "remove",
+	metric_val_set_uint64(priv->pf_state_ops_vals[2],
 	    priv->status.fcounters[FCNT_STATE_REMOVALS]);
 
-	metric_update(priv->pf_src_nodes, priv->status.src_nodes);
-	metric_update(priv->pf_src_node_ops, "search",
+	metric_val_set_uint64(priv->pf_src_nodes_val, priv->status.src_nodes);
+	metric_val_set_uint64(priv->pf_src_node_ops_vals[0],
 	    priv->status.scounters[SCNT_SRC_NODE_SEARCH]);
-	metric_update(priv->pf_src_node_ops, "insert",
+	metric_val_set_uint64(priv->pf_src_node_ops_vals[1],
 	    priv->status.scounters[SCNT_SRC_NODE_INSERT]);
-	metric_update(priv->pf_src_node_ops, "remove",
+	metric_val_set_uint64(priv->pf_src_node_ops_vals[2],
 	    priv->status.scounters[SCNT_SRC_NODE_REMOVALS]);
 
-	metric_update(priv->pf_state_limit,
+	metric_val_set_uint64(priv->pf_state_limit_val,
 	    priv->status.lcounters[LCNT_STATES]);
 
-	metric_update(priv->pf_src_limits, "max-src-states",
+	metric_val_set_uint64(priv->pf_src_limits_vals[0],
 	    priv->status.lcounters[LCNT_SRCSTATES]);
-	metric_update(priv->pf_src_limits, "max-src-nodes",
+	metric_val_set_uint64(priv->pf_src_limits_vals[1],
 	    priv->status.lcounters[LCNT_SRCNODES]);
-	metric_update(priv->pf_src_limits, "max-src-conn",
+	metric_val_set_uint64(priv->pf_src_limits_vals[2],
 	    priv->status.lcounters[LCNT_SRCCONN]);
-	metric_update(priv->pf_src_limits, "max-src-conn-rate",
+	metric_val_set_uint64(priv->pf_src_limits_vals[3],
 	    priv->status.lcounters[LCNT_SRCCONNRATE]);
 
-	metric_update(priv->pf_overloads,
+	metric_val_set_uint64(priv->pf_overloads_val,
 	    priv->status.lcounters[LCNT_OVERLOAD_TABLE]);
-	metric_update(priv->pf_overload_flushes,
+	metric_val_set_uint64(priv->pf_overload_flushes_val,
 	    priv->status.lcounters[LCNT_OVERLOAD_FLUSH]);
 
-	for (i = 0; drop_names[i] != NULL; ++i) {
-		metric_update(priv->pf_drops, drop_names[i],
-		    priv->status.counters[i]);
+	for (i = 0; i < PFRES_MAX; ++i) {
+		if (priv->pf_drops_vals[i] != NULL) {
+			metric_val_set_uint64(priv->pf_drops_vals[i],
+			    priv->status.counters[i]);
+		}
+		if (priv->drop_names[i] == NULL ||
+		    !burst_sampled(priv->burst, i))
+			continue;
+		if (priv->pf_drops_burst_vals[i] == NULL) {
+			priv->pf_drops_burst_vals[i] = metric_val_get(
+			    priv->pf_drops_burst, priv->drop_names[i]);
+		}
+		burst_flush(priv->burst, i, priv->pf_drops_burst_vals[i]);
 	}
 
 	return (0);
 }
 
+static void
+pf_sample(void *modpriv)
+{
+	struct pf_modpriv *priv = modpriv;
+	struct pf_status status;
+	size_t size = sizeof (status);
+	int mib[3] = { CTL_KERN, KERN_PFSTATUS };
+	size_t i;
+
+	if (ksysctl(mib, 2, &status, &size) == -1)
+		return;
+	for (i = 0; i < PFRES_MAX; ++i)
+		burst_sample(priv->burst, i, status.counters[i]);
+}
+
 static void
 pf_free(void *modpriv)
 {
 	struct pf_modpriv *priv = modpriv;
+	size_t i;
+
+	metric_val_release(priv->pf_running_val);
+	metric_val_release(priv->pf_states_val);
+	metric_val_release(priv->pf_src_nodes_val);
+	metric_val_release(priv->pf_state_limit_val);
+	metric_val_release(priv->pf_overloads_val);
+	metric_val_release(priv->pf_overload_flushes_val);
+	for (i = 0; i < 3; ++i) {
+		metric_val_release(priv->pf_state_ops_vals[i]);
+		metric_val_release(priv->pf_src_node_ops_vals[i]);
+	}
+	for (i = 0; i < 4; ++i)
+		metric_val_release(priv->pf_src_limits_vals[i]);
+	for (i = 0; i < PFRES_MAX; ++i) {
+		metric_val_release(priv->pf_drops_vals[i]);
+		metric_val_release(priv->pf_drops_burst_vals[i]);
+	}
+	burst_free(priv->burst);
 	free(priv);
 }
 
 struct metrics_module_ops collect_pf_ops = {
+	.mm_name = "pf",
 	.mm_register = pf_register,
 	.mm_collect = pf_collect,
+	.mm_sample = pf_sample,
 	.mm_free = pf_free
 };
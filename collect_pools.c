@@ -36,14 +36,74 @@
 #include <sys/signal.h>
 #include <sys/pool.h>
 
+#include "ksysctl.h"
 #include "metrics.h"
 #include "log.h"
 
+enum pool_metric {
+	POOL_SIZE,
+	POOL_NITEMS,
+	POOL_NOUT,
+	POOL_NGET,
+	POOL_NPUT,
+	POOL_NFAIL,
+	POOL_NPAGEALLOC,
+	POOL_NPAGEFREE,
+	POOL_HIWAT,
+	POOL_NIDLE,
+	POOL_NMETRICS
+};
+
+static const struct metric_label_desc pool_labels[] = {
+	{ "pool", METRIC_VAL_STRING }
+};
+
+#define	POOL_METRIC(_name, _help, _type) {				\
+	.md_name = (_name), .md_help = (_help), .md_type = (_type),	\
+	.md_val_type = METRIC_VAL_UINT64, .md_labels = pool_labels,	\
+	.md_nlabels = 1 }
+
+static const struct metric_desc pool_metrics[POOL_NMETRICS] = {
+	[POOL_SIZE] = POOL_METRIC("pool_item_size_bytes",
+	    "Size of an item in a particular pool", METRIC_GAUGE),
+	[POOL_NITEMS] = POOL_METRIC("pool_items",
+	    "Number of items in a particular pool", METRIC_GAUGE),
+	[POOL_NOUT] = POOL_METRIC("pool_items_allocated",
+	    "Number of items allocated from a particular pool", METRIC_GAUGE),
+
+	[POOL_NGET] = POOL_METRIC("pool_gets_total",
+	    "Number of times a pool has allocated an item successfully",
+	    METRIC_COUNTER),
+	[POOL_NPUT] = POOL_METRIC("pool_puts_total",
+	    "Number of times a pool has released an item successfully",
+	    METRIC_COUNTER),
+	[POOL_NFAIL] = POOL_METRIC("pool_fails_total",
+	    "Number of times a pool has failed to allocate an item",
+	    METRIC_COUNTER),
+
+	[POOL_NPAGEALLOC] = POOL_METRIC("pool_page_allocs_total",
+	    "Number of times a pool has allocated a new page", METRIC_COUNTER),
+	[POOL_NPAGEFREE] = POOL_METRIC("pool_page_frees_total",
+	    "Number of times a pool has released a page", METRIC_COUNTER),
+
+	[POOL_HIWAT] = POOL_METRIC("pool_pages_max_allocated",
+	    "Maximum number of pages a pool has allocated at once "
+	    "(high water mark)", METRIC_GAUGE),
+	[POOL_NIDLE] = POOL_METRIC("pool_pages_idle",
+	    "Number of idle pages currently in a pool", METRIC_GAUGE)
+};
+
+/* Cached metric_val handles for one pool, by pool index. */
+struct pool_entry {
+	char name[32];
+	struct metric_val *vals[POOL_NMETRICS];
+};
+
 struct pools_modpriv {
 	struct kinfo_pool stats;
-	struct metric *size, *nitems, *nout;
-	struct metric *nget, *nput, *nfail;
-	struct metric *npagealloc, *npagefree, *hiwat, *nidle;
+	struct metric *metrics[POOL_NMETRICS];
+	struct pool_entry *pools;
+	int npools;
 };
 
 struct metric_ops pools_metric_ops = {
@@ -59,60 +119,32 @@ pools_register(struct registry *r, void **modpriv)
 	priv = calloc(1, sizeof (struct pools_modpriv));
 	*modpriv = priv;
 
-	priv->size = metric_new(r, "pool_item_size_bytes",
-	    "Size of an item in a particular pool",
-	    METRIC_GAUGE, METRIC_VAL_UINT64, NULL, &pools_metric_ops,
-	    metric_label_new("pool", METRIC_VAL_STRING),
-	    NULL);
-	priv->nitems = metric_new(r, "pool_items",
-	    "Number of items in a particular pool",
-	    METRIC_GAUGE, METRIC_VAL_UINT64, NULL, &pools_metric_ops,
-	    metric_label_new("pool", METRIC_VAL_STRING),
-	    NULL);
-	priv->nout = metric_new(r, "pool_items_allocated",
-	    "Number of items allocated from a particular pool",
-	    METRIC_GAUGE, METRIC_VAL_UINT64, NULL, &pools_metric_ops,
-	    metric_label_new("pool", METRIC_VAL_STRING),
-	    NULL);
-
-	priv->nget = metric_new(r, "pool_gets_total",
-	    "Number of times a pool has allocated an item successfully",
-	    METRIC_COUNTER, METRIC_VAL_UINT64, NULL, &pools_metric_ops,
-	    metric_label_new("pool", METRIC_VAL_STRING),
-	    NULL);
-	priv->nput = metric_new(r, "pool_puts_total",
-	    "Number of times a pool has released an item successfully",
-	    METRIC_COUNTER, METRIC_VAL_UINT64, NULL, &pools_metric_ops,
-	    metric_label_new("pool", METRIC_VAL_STRING),
-	    NULL);
-	priv->nfail = metric_new(r, "pool_fails_total",
-	    "Number of times a pool has failed to allocate an item",
-	    METRIC_COUNTER, METRIC_VAL_UINT64, NULL, &pools_metric_ops,
-	    metric_label_new("pool", METRIC_VAL_STRING),
-	    NULL);
-
-	priv->npagealloc = metric_new(r, "pool_page_allocs_total",
-	    "Number of times a pool has allocated a new page",
-	    METRIC_COUNTER, METRIC_VAL_UINT64, NULL, &pools_metric_ops,
-	    metric_label_new("pool", METRIC_VAL_STRING),
-	    NULL);
-	priv->npagefree = metric_new(r, "pool_page_frees_total",
-	    "Number of times a pool has released a page",
-	    METRIC_COUNTER, METRIC_VAL_UINT64, NULL, &pools_metric_ops,
-	    metric_label_new("pool", METRIC_VAL_STRING),
-	    NULL);
-
-	priv->hiwat = metric_new(r, "pool_pages_max_allocated",
-	    "Maximum number of pages a pool has allocated at once "
-	    "(high water mark)",
-	    METRIC_GAUGE, METRIC_VAL_UINT64, NULL, &pools_metric_ops,
-	    metric_label_new("pool", METRIC_VAL_STRING),
-	    NULL);
-	priv->nidle = metric_new(r, "pool_pages_idle",
-	    "Number of idle pages currently in a pool",
-	    METRIC_GAUGE, METRIC_VAL_UINT64, NULL, &pools_metric_ops,
-	    metric_label_new("pool", METRIC_VAL_STRING),
-	    NULL);
+	metric_new_table(r, pool_metrics, POOL_NMETRICS, NULL,
+	    &pools_metric_ops, priv->metrics);
+}
+
+static void
+pool_entry_release(struct pool_entry *pe)
+{
+	metric_val_release_table(pe->vals, POOL_NMETRICS);
+	bzero(pe, sizeof (*pe));
+}
+
+static struct pool_entry *
+pool_entry_get(struct pools_modpriv *priv, int i, const char *name)
+{
+	struct pool_entry *pe = &priv->pools[i - 1];
+	union metric_label_val lv = { .mlv_string = name };
+
+	if (pe->vals[0] != NULL && strcmp(pe->name, name) == 0)
+		return (pe);
+
+	pool_entry_release(pe);
+	strlcpy(pe->name, name, sizeof (pe->name));
+
+	metric_val_get_table(priv->metrics, POOL_NMETRICS, &lv, pe->vals);
+
+	return (pe);
 }
 
 static int
@@ -125,18 +157,34 @@ pools_collect(void *modpriv)
 	int namemib[] = { CTL_KERN, KERN_POOL, KERN_POOL_NAME, 0 };
 	int pmib[] = { CTL_KERN, KERN_POOL, KERN_POOL_POOL, 0 };
 	char namebuf[32];
+	struct pool_entry *pe;
+	uint64_t v[POOL_NMETRICS];
 
 	size = sizeof (npools);
-	if (sysctl(nmib, 3, &npools, &size, NULL, 0) == -1) {
+	if (ksysctl(nmib, 3, &npools, &size) == -1) {
 		tslog("failed to get npools: %s", strerror(errno));
 		return (0);
 	}
 
+	if (npools > priv->npools) {
+		pe = recallocarray(priv->pools, priv->npools, npools,
+		    sizeof (struct pool_entry));
+		if (pe == NULL) {
+			tslog("failed to expand pool cache: %s",
+			    strerror(errno));
+			return (0);
+		}
+		priv->pools = pe;
+		priv->npools = npools;
+	}
+	for (i = npools; i < priv->npools; ++i)
+		pool_entry_release(&priv->pools[i]);
+
 	for (i = 1; i <= npools; ++i) {
 		size = sizeof (namebuf);
 		bzero(namebuf, sizeof (namebuf));
 		namemib[3] = i;
-		if (sysctl(namemib, 4, namebuf, &size, NULL, 0) == -1) {
+		if (ksysctl(namemib, 4, namebuf, &size) == -1) {
 			tslog("failed to get pool name %d: %s", i,
 			    strerror(errno));
 			return (0);
@@ -144,39 +192,27 @@ pools_collect(void *modpriv)
 
 		size = sizeof (priv->stats);
 		pmib[3] = i;
-		if (sysctl(pmib, 4, &priv->stats, &size, NULL, 0) == -1) {
+		if (ksysctl(pmib, 4, &priv->stats, &size) == -1) {
 			tslog("failed to get pool stats %d: %s", i,
 			    strerror(errno));
 			return (0);
 		}
 
-		metric_update(priv->size, namebuf, priv->stats.pr_size);
-		metric_update(priv->nitems, namebuf, priv->stats.pr_nitems);
-		metric_update(priv->nout, namebuf, priv->stats.pr_nout);
-
-		metric_update(priv->nget, namebuf, priv->stats.pr_nget);
-		metric_update(priv->nput, namebuf, priv->stats.pr_nput);
-		metric_update(priv->nfail, namebuf, priv->stats.pr_nfail);
-		metric_update(priv->npagealloc, namebuf,
-		    priv->stats.pr_npagealloc);
-		metric_update(priv->npagefree, namebuf,
-		    priv->stats.pr_npagefree);
-
-		metric_update(priv->hiwat, namebuf, priv->stats.pr_hiwat);
-		metric_update(priv->nidle, namebuf, priv->stats.pr_nidle);
+		pe = pool_entry_get(priv, i, namebuf);
+
+		v[POOL_SIZE] = priv->stats.pr_size;
+		v[POOL_NITEMS] = priv->stats.pr_nitems;
+		v[POOL_NOUT] = priv->stats.pr_nout;
+		v[POOL_NGET] = priv->stats.pr_nget;
+		v[POOL_NPUT] = priv->stats.pr_nput;
+		v[POOL_NFAIL] = priv->stats.pr_nfail;
+		v[POOL_NPAGEALLOC] = priv->stats.pr_npagealloc;
+		v[POOL_NPAGEFREE] = priv->stats.pr_npagefree;
+		v[POOL_HIWAT] = priv->stats.pr_hiwat;
+		v[POOL_NIDLE] = priv->stats.pr_nidle;
+		metric_vals_set_uint64(pe->vals, v, POOL_NMETRICS);
 	}
 
-	metric_clear_old_values(priv->size);
-	metric_clear_old_values(priv->nitems);
-	metric_clear_old_values(priv->nout);
-	metric_clear_old_values(priv->nget);
-	metric_clear_old_values(priv->nput);
-	metric_clear_old_values(priv->nfail);
-	metric_clear_old_values(priv->npagealloc);
-	metric_clear_old_values(priv->npagefree);
-	metric_clear_old_values(priv->hiwat);
-	metric_clear_old_values(priv->nidle);
-
 	return (0);
 }
 
@@ -184,10 +220,18 @@ static void
 pools_free(void *modpriv)
 {
 	struct pools_modpriv *priv = modpriv;
+	int i;
+
+	for (i = 0; i < priv->npools; ++i)
+		pool_entry_release(&priv->pools[i]);
+	free(priv->pools);
 	free(priv);
 }
 
 struct metrics_module_ops collect_pools_ops = {
+	.mm_name = "pools",
+	/* two sysctls per pool, and there are hundreds of pools */
+	.mm_interval = 60,
 	.mm_register = pools_register,
 	.mm_collect = pools_collect,
 	.mm_free = pools_free
@@ -33,6 +33,7 @@
 
 #include <sys/sysctl.h>
 
+#include "ksysctl.h"
 #include "metrics.h"
 #include "log.h"
 #include <sys/timeout.h>
@@ -44,6 +45,12 @@ struct procs_modpriv {
 	struct metric *run_thread, *scheduled, *softclocks, *thread_wakeups;
 	struct metric *nfiles, *nprocs, *nthreads;
 	struct metric *maxfiles, *maxproc, *maxthread;
+	struct metric_val *added_val, *cancelled_val, *deleted_val, *late_val;
+	struct metric_val *pending_val, *readded_val, *rescheduled_val;
+	struct metric_val *run_softclock_val, *run_thread_val, *scheduled_val;
+	struct metric_val *softclocks_val, *thread_wakeups_val;
+	struct metric_val *nfiles_val, *nprocs_val, *nthreads_val;
+	struct metric_val *maxfiles_val, *maxproc_val, *maxthread_val;
 };
 
 struct metric_ops procs_metric_ops = {
@@ -131,6 +138,25 @@ procs_register(struct registry *r, void **modpriv)
 	    "Maximum number of threads which can be running on the system",
 	    METRIC_GAUGE, METRIC_VAL_UINT64, NULL, &procs_metric_ops,
 	    NULL);
+
+	priv->added_val = metric_val_get(priv->added);
+	priv->cancelled_val = metric_val_get(priv->cancelled);
+	priv->deleted_val = metric_val_get(priv->deleted);
+	priv->late_val = metric_val_get(priv->late);
+	priv->pending_val = metric_val_get(priv->pending);
+	priv->readded_val = metric_val_get(priv->readded);
+	priv->rescheduled_val = metric_val_get(priv->rescheduled);
+	priv->run_softclock_val = metric_val_get(priv->run_softclock);
+	priv->run_thread_val = metric_val_get(priv->run_thread);
+	priv->scheduled_val = metric_val_get(priv->scheduled);
+	priv->softclocks_val = metric_val_get(priv->softclocks);
+	priv->thread_wakeups_val = metric_val_get(priv->thread_wakeups);
+	priv->nfiles_val = metric_val_get(priv->nfiles);
+	priv->nprocs_val = metric_val_get(priv->nprocs);
+	priv->nthreads_val = metric_val_get(priv->nthreads);
+	priv->maxfiles_val = metric_val_get(priv->maxfiles);
+	priv->maxproc_val = metric_val_get(priv->maxproc);
+	priv->maxthread_val = metric_val_get(priv->maxthread);
 }
 
 static int
@@ -143,70 +169,73 @@ procs_collect(void *modpriv)
 
 	size = sizeof (int);
 	mib[1] = KERN_NFILES;
-	if (sysctl(mib, 2, &v, &size, NULL, 0) == -1) {
+	if (ksysctl(mib, 2, &v, &size) == -1) {
 		tslog("failed to get stats: %s", strerror(errno));
 		return (0);
 	}
-	metric_update(priv->nfiles, (uint64_t)v);
+	metric_val_set_uint64(priv->nfiles_val, (uint64_t)v);
 
 	size = sizeof (int);
 	mib[1] = KERN_NPROCS;
-	if (sysctl(mib, 2, &v, &size, NULL, 0) == -1) {
+	if (ksysctl(mib, 2, &v, &size) == -1) {
 		tslog("failed to get stats: %s", strerror(errno));
 		return (0);
 	}
-	metric_update(priv->nprocs, (uint64_t)v);
+	metric_val_set_uint64(priv->nprocs_val, (uint64_t)v);
 
 	size = sizeof (int);
 	mib[1] = KERN_NTHREADS;
-	if (sysctl(mib, 2, &v, &size, NULL, 0) == -1) {
+	if (ksysctl(mib, 2, &v, &size) == -1) {
 		tslog("failed to get stats: %s", strerror(errno));
 		return (0);
 	}
-	metric_update(priv->nthreads, (uint64_t)v);
+	metric_val_set_uint64(priv->nthreads_val, (uint64_t)v);
 
 	size = sizeof (int);
 	mib[1] = KERN_MAXFILES;
-	if (sysctl(mib, 2, &v, &size, NULL, 0) == -1) {
+	if (ksysctl(mib, 2, &v, &size) == -1) {
 		tslog("failed to get stats: %s", strerror(errno));
 		return (0);
 	}
-	metric_update(priv->maxfiles, (uint64_t)v);
+	metric_val_set_uint64(priv->maxfiles_val, (uint64_t)v);
 
 	size = sizeof (int);
 	mib[1] = KERN_MAXPROC;
-	if (sysctl(mib, 2, &v, &size, NULL, 0) == -1) {
+	if (ksysctl(mib, 2, &v, &size) == -1) {
 		tslog("failed to get stats: %s", strerror(errno));
 		return (0);
 	}
-	metric_update(priv->maxproc, (uint64_t)v);
+	metric_val_set_uint64(priv->maxproc_val, (uint64_t)v);
 
 	size = sizeof (int);
 	mib[1] = KERN_MAXTHREAD;
-	if (sysctl(mib, 2, &v, &size, NULL, 0) == -1) {
+	if (ksysctl(mib, 2, &v, &size) == -1) {
 		tslog("failed to get stats: %s", strerror(errno));
 		return (0);
 	}
-	metric_update(priv->maxthread, (uint64_t)v);
+	metric_val_set_uint64(priv->maxthread_val, (uint64_t)v);
 
 	size = sizeof(priv->tstats);
 	mib[1] = KERN_TIMEOUT_STATS;
-	if (sysctl(mib, 2, &priv->tstats, &size, NULL, 0) == -1) {
+	if (ksysctl(mib, 2, &priv->tstats, &size) == -1) {
 		tslog("failed to get stats: %s", strerror(errno));
 		return (0);
 	}
-	metric_update(priv->added, priv->tstats.tos_added);
-	metric_update(priv->cancelled, priv->tstats.tos_cancelled);
-	metric_update(priv->deleted, priv->tstats.tos_deleted);
-	metric_update(priv->late, priv->tstats.tos_late);
-	metric_update(priv->pending, priv->tstats.tos_pending);
-	metric_update(priv->readded, priv->tstats.tos_readded);
-	metric_update(priv->rescheduled, priv->tstats.tos_rescheduled);
-	metric_update(priv->run_softclock, priv->tstats.tos_run_softclock);
-	metric_update(priv->run_thread, priv->tstats.tos_run_thread);
-	metric_update(priv->scheduled, priv->tstats.tos_scheduled);
-	metric_update(priv->softclocks, priv->tstats.tos_softclocks);
-	metric_update(priv->thread_wakeups, priv->tstats.tos_thread_wakeups);
+	metric_val_set_uint64(priv->added_val, priv->tstats.tos_added);
+	metric_val_set_uint64(priv->cancelled_val, priv->tstats.tos_cancelled);
+	metric_val_set_uint64(priv->deleted_val, priv->tstats.tos_deleted);
+	metric_val_set_uint64(priv->late_val, priv->tstats.tos_late);
+	metric_val_set_uint64(priv->pending_val, priv->tstats.tos_pending);
+	metric_val_set_uint64(priv->readded_val, priv->tstats.tos_readded);
+	metric_val_set_uint64(priv->rescheduled_val,
+	    priv->tstats.tos_rescheduled);
+	metric_val_set_uint64(priv->run_softclock_val,
+	    priv->tstats.tos_run_softclock);
+	metric_val_set_uint64(priv->run_thread_val, priv->tstats.tos_run_thread);
+	metric_val_set_uint64(priv->scheduled_val, priv->tstats.tos_scheduled);
+	metric_val_set_uint64(priv->softclocks_val, priv->tstats.tos_softclocks);
+	metric_val_set_uint64(priv->thread_wakeups_val,
+	    priv->tstats.tos_thread_wakeups);
 
 	return (0);
 }
@@ -215,10 +244,29 @@ static void
 procs_free(void *modpriv)
 {
 	struct procs_modpriv *priv = modpriv;
+	metric_val_release(priv->added_val);
+	metric_val_release(priv->cancelled_val);
+	metric_val_release(priv->deleted_val);
+	metric_val_release(priv->late_val);
+	metric_val_release(priv->pending_val);
+	metric_val_release(priv->readded_val);
+	metric_val_release(priv->rescheduled_val);
+	metric_val_release(priv->run_softclock_val);
+	metric_val_release(priv->run_thread_val);
+	metric_val_release(priv->scheduled_val);
+	metric_val_release(priv->softclocks_val);
+	metric_val_release(priv->thread_wakeups_val);
+	metric_val_release(priv->nfiles_val);
+	metric_val_release(priv->nprocs_val);
+	metric_val_release(priv->nthreads_val);
+	metric_val_release(priv->maxfiles_val);
+	metric_val_release(priv->maxproc_val);
+	metric_val_release(priv->maxthread_val);
 	free(priv);
 }
 
 struct metrics_module_ops collect_procs_ops = {
+	.mm_name = "procs",
 	.mm_register = procs_register,
 	.mm_collect = procs_collect,
 	.mm_free = procs_free
@@ -37,12 +37,14 @@
 #include <sys/signal.h>
 #include <sys/pool.h>
 
+#include "ksysctl.h"
 #include "metrics.h"
 #include "log.h"
 
 struct uvm_modpriv {
 	struct uvmexp stats;
 	struct metric *free, *active, *inactive, *total;
+	struct metric_val *free_val, *active_val, *inactive_val, *total_val;
 };
 
 struct metric_ops uvm_metric_ops = {
@@ -70,6 +72,11 @@ uvm_register(struct registry *r, void **modpriv)
 	priv->total = metric_new(r, "uvm_total_bytes",
 	    "Total bytes in pages managed by uvm",
 	    METRIC_GAUGE, METRIC_VAL_UINT64, NULL, &uvm_metric_ops, NULL);
+
+	priv->free_val = metric_val_get(priv->free);
+	priv->active_val = metric_val_get(priv->active);
+	priv->inactive_val = metric_val_get(priv->inactive);
+	priv->total_val = metric_val_get(priv->total);
 }
 
 static int
@@ -79,19 +86,19 @@ uvm_collect(void *modpriv)
 	size_t size = sizeof (priv->stats);
 	int mib[3] = { CTL_VM, VM_UVMEXP };
 
-	if (sysctl(mib, 2, &priv->stats, &size, NULL, 0) == -1) {
+	if (ksysctl(mib, 2, &priv->stats, &size) == -1) {
 		tslog("failed to get uvm stats: %s", strerror(errno));
 		return (0);
 	}
 
-	metric_update(priv->free,
-	    (uint64_t)((uint64_t)priv->stats.free * priv->stats.pagesize));
-	metric_update(priv->active,
-	    (uint64_t)((uint64_t)priv->stats.active * priv->stats.pagesize));
-	metric_update(priv->inactive,
-	    (uint64_t)((uint64_t)priv->stats.inactive * priv->stats.pagesize));
-	metric_update(priv->total,
-	    (uint64_t)((uint64_t)priv->stats.npages * priv->stats.pagesize));
+	metric_val_set_uint64(priv->free_val,
+	    (uint64_t)priv->stats.free * priv->stats.pagesize);
+	metric_val_set_uint64(priv->active_val,
+	    (uint64_t)priv->stats.active * priv->stats.pagesize);
+	metric_val_set_uint64(priv->inactive_val,
+	    (uint64_t)priv->stats.inactive * priv->stats.pagesize);
+	metric_val_set_uint64(priv->total_val,
+	    (uint64_t)priv->stats.npages * priv->stats.pagesize);
 
 	return (0);
 }
@@ -100,10 +107,15 @@ static void
 uvm_free(void *modpriv)
 {
 	struct uvm_modpriv *priv = modpriv;
+	metric_val_release(priv->free_val);
+	metric_val_release(priv->active_val);
+	metric_val_release(priv->inactive_val);
+	metric_val_release(priv->total_val);
 	free(priv);
 }
 
 struct metrics_module_ops collect_uvm_ops = {
+	.mm_name = "uvm",
 	.mm_register = uvm_register,
 	.mm_collect = uvm_collect,
 	.mm_free = uvm_free
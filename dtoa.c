@@ -0,0 +1,313 @@
+/*
+ *
+ * Copyright 2020 The University of Queensland
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Shortest round-trip formatting of doubles, with Grisu2 (Florian Loitsch,
+ * "Printing Floating-Point Numbers Quickly and Accurately with Integers",
+ * PLDI 2010). Its output always parses back to the same double, and is the
+ * shortest which does for all but a tiny fraction of values (where it's a
+ * digit longer).
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include "dtoa.h"
+
+/* A number f * 2^e */
+struct diyfp {
+	uint64_t f;
+	int e;
+};
+
+static struct diyfp
+diyfp(uint64_t f, int e)
+{
+	struct diyfp x;
+
+	x.f = f;
+	x.e = e;
+	return (x);
+}
+
+/* The upper 64 bits of x * y, rounded */
+static struct diyfp
+diyfp_mul(struct diyfp x, struct diyfp y)
+{
+	const uint64_t lo32 = 0xffffffffULL;
+	uint64_t p0, p1, p2, p3, q;
+
+	p0 = (x.f & lo32) * (y.f & lo32);
+	p1 = (x.f & lo32) * (y.f >> 32);
+	p2 = (x.f >> 32) * (y.f & lo32);
+	p3 = (x.f >> 32) * (y.f >> 32);
+	q = (p0 >> 32) + (p1 & lo32) + (p2 & lo32) + (1ULL << 31);
+	return (diyfp(p3 + (p1 >> 32) + (p2 >> 32) + (q >> 32),
+	    x.e + y.e + 64));
+}
+
+static struct diyfp
+diyfp_normalize(struct diyfp x)
+{
+	while ((x.f >> 63) == 0) {
+		x.f <<= 1;
+		--x.e;
+	}
+	return (x);
+}
+
+/*
+ * Normalised 10^k for k from -300 to 324 in steps of 8, rounded to 64 bits:
+ * enough to bring any double's exponent into [ALPHA, GAMMA].
+ */
+struct cached_power {
+	uint64_t f;
+	int e;
+	int k;
+};
+
+static const struct cached_power cached_powers[] = {
+	{ 0xab70fe17c79ac6caULL, -1060, -300 },
+	{ 0xff77b1fcbebcdc4fULL, -1034, -292 },
+	{ 0xbe5691ef416bd60cULL, -1007, -284 },
+	{ 0x8dd01fad907ffc3cULL,  -980, -276 },
+	{ 0xd3515c2831559a83ULL,  -954, -268 },
+	{ 0x9d71ac8fada6c9b5ULL,  -927, -260 },
+	{ 0xea9c227723ee8bcbULL,  -901, -252 },
+	{ 0xaecc49914078536dULL,  -874, -244 },
+	{ 0x823c12795db6ce57ULL,  -847, -236 },
+	{ 0xc21094364dfb5637ULL,  -821, -228 },
+	{ 0x9096ea6f3848984fULL,  -794, -220 },
+	{ 0xd77485cb25823ac7ULL,  -768, -212 },
+	{ 0xa086cfcd97bf97f4ULL,  -741, -204 },
+	{ 0xef340a98172aace5ULL,  -715, -196 },
+	{ 0xb23867fb2a35b28eULL,  -688, -188 },
+	{ 0x84c8d4dfd2c63f3bULL,  -661, -180 },
+	{ 0xc5dd44271ad3cdbaULL,  -635, -172 },
+	{ 0x936b9fcebb25c996ULL,  -608, -164 },
+	{ 0xdbac6c247d62a584ULL,  -582, -156 },
+	{ 0xa3ab66580d5fdaf6ULL,  -555, -148 },
+	{ 0xf3e2f893dec3f126ULL,  -529, -140 },
+	{ 0xb5b5ada8aaff80b8ULL,  -502, -132 },
+	{ 0x87625f056c7c4a8bULL,  -475, -124 },
+	{ 0xc9bcff6034c13053ULL,  -449, -116 },
+	{ 0x964e858c91ba2655ULL,  -422, -108 },
+	{ 0xdff9772470297ebdULL,  -396, -100 },
+	{ 0xa6dfbd9fb8e5b88fULL,  -369,  -92 },
+	{ 0xf8a95fcf88747d94ULL,  -343,  -84 },
+	{ 0xb94470938fa89bcfULL,  -316,  -76 },
+	{ 0x8a08f0f8bf0f156bULL,  -289,  -68 },
+	{ 0xcdb02555653131b6ULL,  -263,  -60 },
+	{ 0x993fe2c6d07b7facULL,  -236,  -52 },
+	{ 0xe45c10c42a2b3b06ULL,  -210,  -44 },
+	{ 0xaa242499697392d3ULL,  -183,  -36 },
+	{ 0xfd87b5f28300ca0eULL,  -157,  -28 },
+	{ 0xbce5086492111aebULL,  -130,  -20 },
+	{ 0x8cbccc096f5088ccULL,  -103,  -12 },
+	{ 0xd1b71758e219652cULL,   -77,   -4 },
+	{ 0x9c40000000000000ULL,   -50,    4 },
+	{ 0xe8d4a51000000000ULL,   -24,   12 },
+	{ 0xad78ebc5ac620000ULL,     3,   20 },
+	{ 0x813f3978f8940984ULL,    30,   28 },
+	{ 0xc097ce7bc90715b3ULL,    56,   36 },
+	{ 0x8f7e32ce7bea5c70ULL,    83,   44 },
+	{ 0xd5d238a4abe98068ULL,   109,   52 },
+	{ 0x9f4f2726179a2245ULL,   136,   60 },
+	{ 0xed63a231d4c4fb27ULL,   162,   68 },
+	{ 0xb0de65388cc8ada8ULL,   189,   76 },
+	{ 0x83c7088e1aab65dbULL,   216,   84 },
+	{ 0xc45d1df942711d9aULL,   242,   92 },
+	{ 0x924d692ca61be758ULL,   269,  100 },
+	{ 0xda01ee641a708deaULL,   295,  108 },
+	{ 0xa26da3999aef774aULL,   322,  116 },
+	{ 0xf209787bb47d6b85ULL,   348,  124 },
+	{ 0xb454e4a179dd1877ULL,   375,  132 },
+	{ 0x865b86925b9bc5c2ULL,   402,  140 },
+	{ 0xc83553c5c8965d3dULL,   428,  148 },
+	{ 0x952ab45cfa97a0b3ULL,   455,  156 },
+	{ 0xde469fbd99a05fe3ULL,   481,  164 },
+	{ 0xa59bc234db398c25ULL,   508,  172 },
+	{ 0xf6c69a72a3989f5cULL,   534,  180 },
+	{ 0xb7dcbf5354e9beceULL,   561,  188 },
+	{ 0x88fcf317f22241e2ULL,   588,  196 },
+	{ 0xcc20ce9bd35c78a5ULL,   614,  204 },
+	{ 0x98165af37b2153dfULL,   641,  212 },
+	{ 0xe2a0b5dc971f303aULL,   667,  220 },
+	{ 0xa8d9d1535ce3b396ULL,   694,  228 },
+	{ 0xfb9b7cd9a4a7443cULL,   720,  236 },
+	{ 0xbb764c4ca7a44410ULL,   747,  244 },
+	{ 0x8bab8eefb6409c1aULL,   774,  252 },
+	{ 0xd01fef10a657842cULL,   800,  260 },
+	{ 0x9b10a4e5e9913129ULL,   827,  268 },
+	{ 0xe7109bfba19c0c9dULL,   853,  276 },
+	{ 0xac2820d9623bf429ULL,   880,  284 },
+	{ 0x80444b5e7aa7cf85ULL,   907,  292 },
+	{ 0xbf21e44003acdd2dULL,   933,  300 },
+	{ 0x8e679c2f5e44ff8fULL,   960,  308 },
+	{ 0xd433179d9c8cb841ULL,   986,  316 },
+	{ 0x9e19db92b4e31ba9ULL,  1013,  324 },
+};
+
+#define	CACHED_POWERS_MIN_K	-300
+#define	CACHED_POWERS_STEP	8
+
+#define	ALPHA	-60
+#define	GAMMA	-32
+
+/* A cached power which takes a number with exponent e into [ALPHA, GAMMA] */
+static const struct cached_power *
+cached_power(int e)
+{
+	int f, k, i;
+
+	/* ceil((ALPHA - e - 1) * log10(2)) */
+	f = ALPHA - e - 1;
+	k = (f * 78913) / (1 << 18) + (f > 0);
+	i = (-CACHED_POWERS_MIN_K + k + (CACHED_POWERS_STEP - 1)) /
+	    CACHED_POWERS_STEP;
+	return (&cached_powers[i]);
+}
+
+/* The number of decimal digits of n (< 10^10), and 10 to one less than it */
+static int
+largest_pow10(uint32_t n, uint32_t *pow10)
+{
+	uint32_t p = 1000000000;
+	int k = 10;
+
+	while (k > 1 && n < p) {
+		p /= 10;
+		--k;
+	}
+	*pow10 = p;
+	return (k);
+}
+
+/*
+ * Moves the last digit down while that stays within the bounds and gets
+ * closer to the exact value (which is dist below the upper bound).
+ */
+static void
+round_weed(char *digits, int len, uint64_t dist, uint64_t delta,
+    uint64_t rest, uint64_t ten_k)
+{
+	while (rest < dist && delta - rest >= ten_k &&
+	    (rest + ten_k < dist || dist - rest > rest + ten_k - dist)) {
+		--digits[len - 1];
+		rest += ten_k;
+	}
+}
+
+/*
+ * Generates the digits of the scaled upper bound hi until what's left is
+ * below hi - lo, so that they're inside the bounds.
+ */
+static int
+digit_gen(char *digits, int *exp10, struct diyfp lo, struct diyfp w,
+    struct diyfp hi)
+{
+	uint64_t delta = hi.f - lo.f, dist = hi.f - w.f, rest;
+	uint64_t one = 1ULL << -hi.e, p2;
+	uint32_t p1, pow10, d;
+	int len = 0, n, m = 0;
+
+	p1 = (uint32_t)(hi.f >> -hi.e);
+	p2 = hi.f & (one - 1);
+
+	/* the integral part */
+	n = largest_pow10(p1, &pow10);
+	while (n > 0) {
+		d = p1 / pow10;
+		p1 %= pow10;
+		digits[len++] = '0' + d;
+		--n;
+		rest = ((uint64_t)p1 << -hi.e) + p2;
+		if (rest <= delta) {
+			*exp10 += n;
+			round_weed(digits, len, dist, delta, rest,
+			    (uint64_t)pow10 << -hi.e);
+			return (len);
+		}
+		pow10 /= 10;
+	}
+
+	/* then the fractional part, which always ends before 17 digits */
+	for (;;) {
+		p2 *= 10;
+		d = (uint32_t)(p2 >> -hi.e);
+		p2 &= one - 1;
+		digits[len++] = '0' + d;
+		++m;
+		delta *= 10;
+		dist *= 10;
+		if (p2 <= delta)
+			break;
+	}
+	*exp10 -= m;
+	round_weed(digits, len, dist, delta, p2, one);
+	return (len);
+}
+
+int
+dtoa_shortest(double v, char *digits, int *exp10)
+{
+	const uint64_t hidden = 1ULL << 52;
+	const int bias = 1075;
+	const struct cached_power *cp;
+	struct diyfp w, lo, hi, c;
+	uint64_t bits, f;
+	int e;
+
+	bcopy(&v, &bits, sizeof (bits));
+	f = bits & (hidden - 1);
+	e = (int)(bits >> 52);
+	if (e == 0)
+		w = diyfp(f, 1 - bias);
+	else
+		w = diyfp(f + hidden, e - bias);
+
+	/* the bounds: halfway to the doubles either side */
+	hi = diyfp_normalize(diyfp(2 * w.f + 1, w.e - 1));
+	if (f == 0 && e > 1)
+		lo = diyfp(4 * w.f - 1, w.e - 2);
+	else
+		lo = diyfp(2 * w.f - 1, w.e - 1);
+	lo = diyfp(lo.f << (lo.e - hi.e), hi.e);
+	w = diyfp_normalize(w);
+
+	cp = cached_power(hi.e);
+	c = diyfp(cp->f, cp->e);
+	w = diyfp_mul(w, c);
+	lo = diyfp_mul(lo, c);
+	hi = diyfp_mul(hi, c);
+	/* allow for the error in the cached power */
+	++lo.f;
+	--hi.f;
+
+	*exp10 = -cp->k;
+	return (digit_gen(digits, exp10, lo, w, hi));
+}
@@ -0,0 +1,623 @@
+/*
+ *
+ * Copyright 2020 The University of Queensland
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <sys/disk.h>
+#include <sys/pool.h>
+#include <sys/tree.h>
+#include <net/if.h>
+#include <net/if_dl.h>
+#include <net/route.h>
+
+#include "ksysctl.h"
+#include "log.h"
+
+enum ksysctl_mode {
+	KSYSCTL_LIVE,
+	KSYSCTL_RECORD,
+	KSYSCTL_REPLAY
+};
+
+/* How many responses to record for each mib */
+#define	KSYSCTL_RECORD_MAX	8
+
+struct ksresp {
+	uint8_t *kr_data;
+	size_t kr_len;
+	/* built the first time it's given out scaled, if it needs to be */
+	uint8_t *kr_scaled;
+	size_t kr_slen;
+};
+
+struct ksent {
+	RB_ENTRY(ksent) ke_entry;
+	int ke_mib[CTL_MAXNAME];
+	u_int ke_miblen;
+	struct ksresp *ke_resps;
+	size_t ke_nresps;
+	/* the next response for each copy of a scaled item */
+	size_t *ke_next;
+	size_t ke_nnext;
+};
+
+RB_HEAD(kstree, ksent);
+
+static int
+ksent_cmp(const struct ksent *a, const struct ksent *b)
+{
+	u_int i;
+
+	for (i = 0; i < a->ke_miblen && i < b->ke_miblen; ++i) {
+		if (a->ke_mib[i] < b->ke_mib[i])
+			return (-1);
+		if (a->ke_mib[i] > b->ke_mib[i])
+			return (1);
+	}
+	if (a->ke_miblen < b->ke_miblen)
+		return (-1);
+	if (a->ke_miblen > b->ke_miblen)
+		return (1);
+	return (0);
+}
+
+RB_GENERATE_STATIC(kstree, ksent, ke_entry, ksent_cmp);
+
+static const int mib_ncpu[] = { CTL_HW, HW_NCPU };
+static const int mib_cpustats[] = { CTL_KERN, KERN_CPUSTATS };
+static const int mib_npools[] = { CTL_KERN, KERN_POOL, KERN_POOL_NPOOLS };
+static const int mib_poolname[] = { CTL_KERN, KERN_POOL, KERN_POOL_NAME };
+static const int mib_pool[] = { CTL_KERN, KERN_POOL, KERN_POOL_POOL };
+static const int mib_ndisks[] = { CTL_HW, HW_DISKCOUNT };
+static const int mib_diskstats[] = { CTL_HW, HW_DISKSTATS };
+static const int mib_iflist[] = { CTL_NET, PF_ROUTE, 0, 0, NET_RT_IFLIST, 0 };
+
+#define	MIB_IS(_mib, _len, _want)	\
+	mib_is((_mib), (_len), (_want), nitems(_want))
+#define	MIB_INDEXES(_mib, _len, _want)	\
+	mib_indexes((_mib), (_len), (_want), nitems(_want))
+
+/* Set before there are any other threads, and not changed after */
+static enum ksysctl_mode ks_mode = KSYSCTL_LIVE;
+static FILE *ks_file;
+static struct ksysctl_scale ks_scale;
+/* how many of each thing there were in the recording */
+static struct ksysctl_scale ks_recorded;
+
+static pthread_mutex_t ks_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct kstree ks_tree = RB_INITIALIZER(&ks_tree);
+
+static int
+mib_is(const int *mib, u_int miblen, const int *want, u_int wantlen)
+{
+	return (miblen == wantlen &&
+	    bcmp(mib, want, wantlen * sizeof (int)) == 0);
+}
+
+/* Whether mib is want followed by an index */
+static int
+mib_indexes(const int *mib, u_int miblen, const int *want, u_int wantlen)
+{
+	return (miblen == wantlen + 1 &&
+	    bcmp(mib, want, wantlen * sizeof (int)) == 0);
+}
+
+static struct ksent *
+ksent_get(const int *mib, u_int miblen, int create)
+{
+	struct ksent search, *ke;
+
+	bcopy(mib, search.ke_mib, miblen * sizeof (int));
+	search.ke_miblen = miblen;
+	ke = RB_FIND(kstree, &ks_tree, &search);
+	if (ke != NULL || !create)
+		return (ke);
+
+	ke = calloc(1, sizeof (struct ksent));
+	if (ke == NULL)
+		tserr(EXIT_MEMORY, "calloc");
+	bcopy(mib, ke->ke_mib, miblen * sizeof (int));
+	ke->ke_miblen = miblen;
+	RB_INSERT(kstree, &ks_tree, ke);
+	return (ke);
+}
+
+static void
+ksent_free_all(void)
+{
+	struct ksent *ke, *nke;
+	size_t i;
+
+	RB_FOREACH_SAFE(ke, kstree, &ks_tree, nke) {
+		RB_REMOVE(kstree, &ks_tree, ke);
+		for (i = 0; i < ke->ke_nresps; ++i) {
+			free(ke->ke_resps[i].kr_data);
+			free(ke->ke_resps[i].kr_scaled);
+		}
+		free(ke->ke_resps);
+		free(ke->ke_next);
+		free(ke);
+	}
+}
+
+static void
+record(const int *mib, u_int miblen, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	struct ksent *ke;
+	size_t i;
+
+	pthread_mutex_lock(&ks_mtx);
+	ke = ksent_get(mib, miblen, 1);
+	if (ke->ke_nresps < KSYSCTL_RECORD_MAX) {
+		++ke->ke_nresps;
+		for (i = 0; i < miblen; ++i)
+			fprintf(ks_file, "%s%d", (i == 0) ? "" : ".", mib[i]);
+		fputc('\t', ks_file);
+		for (i = 0; i < len; ++i)
+			fprintf(ks_file, "%02x", p[i]);
+		fputc('\n', ks_file);
+		fflush(ks_file);
+	}
+	pthread_mutex_unlock(&ks_mtx);
+}
+
+void
+ksysctl_record(FILE *f)
+{
+	ks_file = f;
+	fprintf(f, "# sysctl fixture: mib<TAB>response in hex\n");
+	ks_mode = KSYSCTL_RECORD;
+}
+
+static int
+hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return (c - '0');
+	if (c >= 'a' && c <= 'f')
+		return (c - 'a' + 10);
+	if (c >= 'A' && c <= 'F')
+		return (c - 'A' + 10);
+	return (-1);
+}
+
+static int
+parse_line(char *line)
+{
+	int mib[CTL_MAXNAME];
+	u_int miblen = 0;
+	char *hex, *tok, *p;
+	struct ksent *ke;
+	struct ksresp *kr;
+	size_t i, len;
+	long v;
+	int hi, lo;
+
+	hex = strchr(line, '\t');
+	if (hex == NULL)
+		return (EINVAL);
+	*hex++ = '\0';
+	len = strlen(hex);
+	if (len % 2 != 0)
+		return (EINVAL);
+	len /= 2;
+
+	while ((tok = strsep(&line, ".")) != NULL) {
+		errno = 0;
+		v = strtol(tok, &p, 10);
+		if (errno != 0 || p == tok || *p != '\0' ||
+		    miblen == CTL_MAXNAME)
+			return (EINVAL);
+		mib[miblen++] = v;
+	}
+
+	ke = ksent_get(mib, miblen, 1);
+	kr = recallocarray(ke->ke_resps, ke->ke_nresps, ke->ke_nresps + 1,
+	    sizeof (struct ksresp));
+	if (kr == NULL)
+		tserr(EXIT_MEMORY, "recallocarray");
+	ke->ke_resps = kr;
+	kr = &kr[ke->ke_nresps++];
+	kr->kr_len = len;
+	kr->kr_data = malloc(len + 1);
+	if (kr->kr_data == NULL)
+		tserr(EXIT_MEMORY, "malloc");
+	for (i = 0; i < len; ++i) {
+		hi = hexval(hex[2 * i]);
+		lo = hexval(hex[2 * i + 1]);
+		if (hi < 0 || lo < 0)
+			return (EINVAL);
+		kr->kr_data[i] = (hi << 4) | lo;
+	}
+	return (0);
+}
+
+/* The int in the first response recorded for mib, or 0 */
+static u_int
+recorded_int(const int *mib, u_int miblen)
+{
+	struct ksent *ke;
+	int v;
+
+	ke = ksent_get(mib, miblen, 0);
+	if (ke == NULL || ke->ke_resps[0].kr_len != sizeof (int))
+		return (0);
+	bcopy(ke->ke_resps[0].kr_data, &v, sizeof (int));
+	return ((v > 0) ? v : 0);
+}
+
+/*
+ * Finds the interfaces in a NET_RT_IFLIST response: the RTM_IFINFO messages
+ * (which only carry RTA_IFP) with a name. Returns how many, and the array of
+ * them in *msgsp.
+ */
+static size_t
+iflist_parse(const uint8_t *buf, size_t len, const uint8_t ***msgsp)
+{
+	const uint8_t *next, *lim = buf + len, **msgs = NULL;
+	struct if_msghdr ifm;
+	struct sockaddr_dl sdl;
+	size_t n = 0;
+
+	for (next = buf; next + sizeof (ifm) <= lim; next += ifm.ifm_msglen) {
+		bcopy(next, &ifm, sizeof (ifm));
+		if (ifm.ifm_msglen == 0)
+			break;
+		if (ifm.ifm_version != RTM_VERSION ||
+		    ifm.ifm_type != RTM_IFINFO ||
+		    ifm.ifm_addrs != RTA_IFP)
+			continue;
+		if (next + sizeof (ifm) + sizeof (sdl) > lim)
+			break;
+		bcopy(next + sizeof (ifm), &sdl, sizeof (sdl));
+		if (sdl.sdl_family != AF_LINK || sdl.sdl_nlen == 0)
+			continue;
+		msgs = reallocarray(msgs, n + 1, sizeof (uint8_t *));
+		if (msgs == NULL)
+			tserr(EXIT_MEMORY, "reallocarray");
+		msgs[n++] = next;
+	}
+	*msgsp = msgs;
+	return (n);
+}
+
+int
+ksysctl_replay(FILE *f, const struct ksysctl_scale *scale)
+{
+	char *line = NULL;
+	size_t lsize = 0;
+	ssize_t llen;
+	struct ksent *ke;
+	const uint8_t **msgs;
+	int rc = 0;
+
+	while (rc == 0 && (llen = getline(&line, &lsize, f)) != -1) {
+		if (llen > 0 && line[llen - 1] == '\n')
+			line[--llen] = '\0';
+		if (line[0] == '#' || line[0] == '\0')
+			continue;
+		rc = parse_line(line);
+	}
+	free(line);
+	if (rc == 0 && ferror(f))
+		rc = EIO;
+	if (rc != 0) {
+		ksent_free_all();
+		return (rc);
+	}
+
+	bzero(&ks_recorded, sizeof (ks_recorded));
+	ks_recorded.ks_cpus = recorded_int(mib_ncpu, nitems(mib_ncpu));
+	ks_recorded.ks_pools = recorded_int(mib_npools, nitems(mib_npools));
+	ks_recorded.ks_disks = recorded_int(mib_ndisks, nitems(mib_ndisks));
+	ke = ksent_get(mib_iflist, nitems(mib_iflist), 0);
+	if (ke != NULL) {
+		ks_recorded.ks_ifs = iflist_parse(ke->ke_resps[0].kr_data,
+		    ke->ke_resps[0].kr_len, &msgs);
+		free(msgs);
+	}
+
+	bzero(&ks_scale, sizeof (ks_scale));
+	if (scale != NULL)
+		ks_scale = *scale;
+	/* there's nothing to make copies of */
+	if (ks_recorded.ks_cpus == 0)
+		ks_scale.ks_cpus = 0;
+	if (ks_recorded.ks_pools == 0)
+		ks_scale.ks_pools = 0;
+	if (ks_recorded.ks_ifs == 0)
+		ks_scale.ks_ifs = 0;
+	if (ks_recorded.ks_disks == 0)
+		ks_scale.ks_disks = 0;
+
+	ks_mode = KSYSCTL_REPLAY;
+	return (0);
+}
+
+/*
+ * Rewrites mib (a copy) to the recorded item a scaled one is a copy of, and
+ * returns which copy it is.
+ */
+static u_int
+unscale(int *mib, u_int miblen)
+{
+	u_int i, copy = 0;
+
+	if (ks_scale.ks_cpus > 0 &&
+	    MIB_INDEXES(mib, miblen, mib_cpustats) && mib[miblen - 1] >= 0) {
+		i = mib[miblen - 1];
+		copy = i / ks_recorded.ks_cpus;
+		mib[miblen - 1] = i % ks_recorded.ks_cpus;
+	}
+	if (ks_scale.ks_pools > 0 && mib[miblen - 1] > 0 &&
+	    (MIB_INDEXES(mib, miblen, mib_poolname) ||
+	    MIB_INDEXES(mib, miblen, mib_pool))) {
+		i = mib[miblen - 1] - 1;
+		copy = i / ks_recorded.ks_pools;
+		mib[miblen - 1] = i % ks_recorded.ks_pools + 1;
+	}
+	return (copy);
+}
+
+/*
+ * Names copy of name, keeping the suffix if it has to be shortened so that
+ * the copies stay distinct.
+ */
+static void
+copy_name(char *buf, size_t size, const char *name, size_t namelen,
+    u_int copy)
+{
+	char suffix[16];
+	int n;
+
+	n = snprintf(suffix, sizeof (suffix), ".%u", copy);
+	if (namelen + n >= size)
+		namelen = size - n - 1;
+	bcopy(name, buf, namelen);
+	bcopy(suffix, buf + namelen, n + 1);
+}
+
+static void
+scale_diskstats(struct ksresp *kr)
+{
+	struct diskstats *ds;
+	char name[DS_DISKNAMELEN];
+	size_t n, i, rec;
+
+	rec = kr->kr_len / sizeof (struct diskstats);
+	n = ks_scale.ks_disks;
+	if (rec == 0)
+		n = 0;
+	ds = calloc(n + 1, sizeof (struct diskstats));
+	if (ds == NULL)
+		tserr(EXIT_MEMORY, "calloc");
+	for (i = 0; i < n; ++i) {
+		bcopy(kr->kr_data + (i % rec) * sizeof (struct diskstats),
+		    &ds[i], sizeof (struct diskstats));
+		if (i < rec)
+			continue;
+		bcopy(ds[i].ds_name, name, sizeof (name));
+		copy_name(ds[i].ds_name, sizeof (ds[i].ds_name), name,
+		    strnlen(name, sizeof (name)), i / rec);
+	}
+	kr->kr_scaled = (uint8_t *)ds;
+	kr->kr_slen = n * sizeof (struct diskstats);
+}
+
+/*
+ * The copies of an interface only have RTA_IFP, which is all the collector
+ * uses. Their indexes follow on from the highest recorded one.
+ */
+static void
+scale_iflist(struct ksresp *kr)
+{
+	const uint8_t **msgs;
+	struct if_msghdr ifm;
+	struct sockaddr_dl sdl;
+	char name[IFNAMSIZ];
+	size_t n, i, rec, maxlen = 0, off = 0, sdllen;
+	u_int copy, maxidx = 0;
+	uint8_t *buf;
+
+	rec = iflist_parse(kr->kr_data, kr->kr_len, &msgs);
+	n = (rec > 0) ? ks_scale.ks_ifs : 0;
+	sdllen = roundup(sizeof (sdl), sizeof (long));
+	for (i = 0; i < rec; ++i) {
+		bcopy(msgs[i], &ifm, sizeof (ifm));
+		if (ifm.ifm_msglen > maxlen)
+			maxlen = ifm.ifm_msglen;
+		if (ifm.ifm_index > maxidx)
+			maxidx = ifm.ifm_index;
+	}
+	if (sizeof (ifm) + sdllen > maxlen)
+		maxlen = sizeof (ifm) + sdllen;
+
+	buf = calloc(n + 1, maxlen);
+	if (buf == NULL)
+		tserr(EXIT_MEMORY, "calloc");
+	for (i = 0; i < n; ++i) {
+		bcopy(msgs[i % rec], &ifm, sizeof (ifm));
+		copy = i / rec;
+		if (copy == 0) {
+			bcopy(msgs[i], buf + off, ifm.ifm_msglen);
+			off += ifm.ifm_msglen;
+			continue;
+		}
+		bcopy(msgs[i % rec] + sizeof (ifm), &sdl, sizeof (sdl));
+		ifm.ifm_index += copy * (maxidx + 1);
+		copy_name(name, sizeof (name), sdl.sdl_data,
+		    MIN(sdl.sdl_nlen, sizeof (name) - 1), copy);
+		sdl.sdl_nlen = strlen(name);
+		bcopy(name, sdl.sdl_data, sdl.sdl_nlen);
+		sdl.sdl_alen = 0;
+		sdl.sdl_slen = 0;
+		sdl.sdl_len = sizeof (sdl);
+		sdl.sdl_index = ifm.ifm_index;
+
+		ifm.ifm_addrs = RTA_IFP;
+		ifm.ifm_hdrlen = sizeof (ifm);
+		ifm.ifm_msglen = sizeof (ifm) + sdllen;
+		bcopy(&ifm, buf + off, sizeof (ifm));
+		bcopy(&sdl, buf + off + sizeof (ifm), sizeof (sdl));
+		off += ifm.ifm_msglen;
+	}
+	free(msgs);
+	kr->kr_scaled = buf;
+	kr->kr_slen = off;
+}
+
+static int
+copy_out(const void *data, size_t dlen, void *buf, size_t *len)
+{
+	if (buf == NULL) {
+		*len = dlen;
+		return (0);
+	}
+	if (*len < dlen) {
+		bcopy(data, buf, *len);
+		errno = ENOMEM;
+		return (-1);
+	}
+	bcopy(data, buf, dlen);
+	*len = dlen;
+	return (0);
+}
+
+static int
+replay(const int *mib, u_int miblen, void *buf, size_t *len)
+{
+	int rmib[CTL_MAXNAME];
+	char name[64];
+	struct ksent *ke;
+	struct ksresp *kr;
+	size_t *next;
+	u_int copy;
+	int count = 0;
+
+	if (miblen == 0 || miblen > CTL_MAXNAME) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	/* how many of the scaled things there are is answered directly */
+	if (MIB_IS(mib, miblen, mib_ncpu))
+		count = ks_scale.ks_cpus;
+	else if (MIB_IS(mib, miblen, mib_npools))
+		count = ks_scale.ks_pools;
+	else if (MIB_IS(mib, miblen, mib_ndisks))
+		count = ks_scale.ks_disks;
+	if (count > 0)
+		return (copy_out(&count, sizeof (count), buf, len));
+
+	bcopy(mib, rmib, miblen * sizeof (int));
+	copy = unscale(rmib, miblen);
+	ke = ksent_get(rmib, miblen, 0);
+	if (ke == NULL) {
+		errno = ENOENT;
+		return (-1);
+	}
+
+	if (copy >= ke->ke_nnext) {
+		next = recallocarray(ke->ke_next, ke->ke_nnext, copy + 1,
+		    sizeof (size_t));
+		if (next == NULL) {
+			errno = ENOMEM;
+			return (-1);
+		}
+		ke->ke_next = next;
+		ke->ke_nnext = copy + 1;
+	}
+	next = &ke->ke_next[copy];
+	kr = &ke->ke_resps[*next];
+	/* only a read moves on: asking for the size comes before it */
+	if (buf != NULL)
+		*next = (*next + 1) % ke->ke_nresps;
+
+	if (ks_scale.ks_disks > 0 && MIB_IS(mib, miblen, mib_diskstats)) {
+		if (kr->kr_scaled == NULL)
+			scale_diskstats(kr);
+		return (copy_out(kr->kr_scaled, kr->kr_slen, buf, len));
+	}
+	if (ks_scale.ks_ifs > 0 && MIB_IS(mib, miblen, mib_iflist)) {
+		if (kr->kr_scaled == NULL)
+			scale_iflist(kr);
+		return (copy_out(kr->kr_scaled, kr->kr_slen, buf, len));
+	}
+	if (copy > 0 && MIB_INDEXES(mib, miblen, mib_poolname)) {
+		copy_name(name, sizeof (name), (const char *)kr->kr_data,
+		    MIN(strnlen((const char *)kr->kr_data, kr->kr_len),
+		    sizeof (name) - 1), copy);
+		return (copy_out(name, strlen(name) + 1, buf, len));
+	}
+	return (copy_out(kr->kr_data, kr->kr_len, buf, len));
+}
+
+/*
+ * Only OpenBSD has the sysctls (and layouts) the collectors want. Elsewhere
+ * they can still run from a fixture, with the layouts from bench/compat.
+ */
+static int
+live(const int *mib, u_int miblen, void *buf, size_t *len)
+{
+#if defined(__OpenBSD__)
+	return (sysctl(mib, miblen, buf, len, NULL, 0));
+#else
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif
+}
+
+int
+ksysctl(const int *mib, u_int miblen, void *buf, size_t *len)
+{
+	int rc;
+
+	switch (ks_mode) {
+	case KSYSCTL_RECORD:
+		rc = live(mib, miblen, buf, len);
+		if (rc == 0 && buf != NULL)
+			record(mib, miblen, buf, *len);
+		return (rc);
+	case KSYSCTL_REPLAY:
+		pthread_mutex_lock(&ks_mtx);
+		rc = replay(mib, miblen, buf, len);
+		pthread_mutex_unlock(&ks_mtx);
+		return (rc);
+	default:
+		return (live(mib, miblen, buf, len));
+	}
+}
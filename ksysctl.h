@@ -0,0 +1,65 @@
+/*
+ *
+ * Copyright 2020 The University of Queensland
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#if !defined(_KSYSCTL_H)
+#define _KSYSCTL_H
+
+#include <sys/types.h>
+#include <stdio.h>
+
+/*
+ * The collectors read the kernel through ksysctl(), which is sysctl(2) for
+ * reading only. Its responses can be recorded to a fixture file, and the
+ * collectors later run against the fixture instead of the kernel. Away from
+ * OpenBSD only the fixture is there; otherwise it fails with EOPNOTSUPP.
+ */
+int ksysctl(const int *mib, u_int miblen, void *buf, size_t *len);
+
+/*
+ * Writes each kind of response to f as ksysctl() sees it, up to a few times
+ * (so that counters move when it's replayed).
+ */
+void ksysctl_record(FILE *f);
+
+/*
+ * How many of each thing to pretend there are when replaying. Zero keeps the
+ * number recorded; more are made up by repeating the recorded ones, with
+ * their names suffixed ".1", ".2" and so on.
+ */
+struct ksysctl_scale {
+	u_int ks_cpus;
+	u_int ks_pools;
+	u_int ks_ifs;
+	u_int ks_disks;
+};
+
+/*
+ * Serves ksysctl() from a fixture read from f from now on, cycling through
+ * the responses recorded for each mib. Returns an errno if f isn't one.
+ */
+int ksysctl_replay(FILE *f, const struct ksysctl_scale *scale);
+
+#endif /* _KSYSCTL_H */
@@ -37,11 +37,15 @@
 #include <time.h>
 #include <stdarg.h>
 #include <err.h>
+#include <pthread.h>
 
 #include "log.h"
 
 FILE *logfile = NULL;
 
+/* protects the static buffer in vtslog(), which the collector also uses */
+static pthread_mutex_t log_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 void
 tslog(const char *fmt, ...)
 {
@@ -87,7 +91,9 @@ vtslog(const char *fmt, int eno, va_list ap)
 	size_t rem;
 	int w;
 	struct timeval tv;
-	struct tm *info;
+	struct tm *info, tmbuf;
+
+	pthread_mutex_lock(&log_mtx);
 
 	if (len == 0) {
 		len = strlen(fmt) * 2 + 64;
@@ -104,7 +110,7 @@ again:
 	bzero(&tv, sizeof (tv));
 	if (gettimeofday(&tv, NULL))
 		err(EXIT_ERROR, "gettimeofday()");
-	info = gmtime(&tv.tv_sec);
+	info = gmtime_r(&tv.tv_sec, &tmbuf);
 	if (info == NULL)
 		err(EXIT_ERROR, "gmtime");
 
@@ -159,4 +165,6 @@ again:
 
 	fprintf(logfile, "%s\n", buf);
 	fflush(logfile);
+
+	pthread_mutex_unlock(&log_mtx);
 }
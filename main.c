@@ -27,29 +27,52 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <ctype.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <strings.h>
 #include <string.h>
 #include <errno.h>
 #include <poll.h>
+#include <fcntl.h>
 #include <time.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include <sys/types.h>
+#include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <err.h>
 
 #include "http-parser/http_parser.h"
+#include "ksysctl.h"
 #include "log.h"
 #include "metrics.h"
 
+extern struct metrics_module_ops
+    collect_pf_ops, collect_cpu_ops, collect_if_ops, collect_uvm_ops,
+    collect_pools_ops, collect_procs_ops, collect_disk_ops;
+static struct metrics_module_ops *const modules[] = {
+	&collect_pf_ops,
+	&collect_cpu_ops,
+	&collect_if_ops,
+	&collect_uvm_ops,
+	&collect_pools_ops,
+	&collect_procs_ops,
+	&collect_disk_ops,
+	NULL
+};
+
 const int BACKLOG = 8;
 const size_t BUFLEN = 2048;
 const size_t REQ_TIMEOUT = 30;
+/* most we'll write to one connection before going back to poll() */
+const size_t SEND_CHUNK = 65536;
+#define	MAX_FILTER_NAMES	16
 
 enum response_type {
 	RESP_NOT_FOUND = 0,
@@ -67,8 +90,41 @@ struct req {
 	enum response_type resp;
 	int sock;
 	int done;
-	FILE *wf;
 	struct registry *registry;
+	/*
+	 * The response: headers, a body from the snapshot (which we hold a
+	 * reference to) and the per-request trailer. It's written out as the
+	 * socket drains, so memory per connection is just head and tail.
+	 */
+	int sending;
+	struct wbuf *head;
+	struct snapshot *snap;
+	/* filtered copy of the snapshot's body, if there's a filter */
+	struct wbuf *body;
+	struct wbuf *tail;
+	struct iovec iov[3];
+	size_t sent;
+	size_t total;
+	/* request target, truncated */
+	char url[512];
+	size_t urllen;
+	/* collect[]= and name[]= from the query string */
+	int filtered;
+	int badquery;
+	struct metrics_filter filter;
+	const char *names[MAX_FILTER_NAMES + 1];
+	size_t nnames;
+	/* header currently being parsed, truncated */
+	char hdrname[32];
+	size_t hdrnamelen;
+	int in_value;
+	/* as much of the Accept and Accept-Encoding headers as fits */
+	char accept[512];
+	size_t acceptlen;
+	char acceptenc[128];
+	size_t acceptenclen;
+	enum metrics_format fmt;
+	int gzip;
 };
 
 static int on_url(http_parser *, const char *, size_t);
@@ -77,11 +133,98 @@ static int on_header_value(http_parser *, const char *, size_t);
 static int on_headers_complete(http_parser *);
 static int on_message_complete(http_parser *);
 
-static char *stats_buf = NULL;
-static size_t stats_buf_sz = 0;
+/*
+ * The collector thread owns the registry once we're up: it collects and
+ * publishes a new snapshot whenever a request asks for one (or every
+ * collect_interval seconds, with -i), while the poll loop carries on serving
+ * the previous snapshot.
+ */
+static pthread_t collector;
+static pthread_mutex_t collect_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t collect_cv = PTHREAD_COND_INITIALIZER;
+/* modules wanted by requests since the last collection */
+static uint64_t collect_mask = 0;
+static unsigned long collect_interval = 0;
+
+/* collection timestamp and age, appended to each response */
+static struct wbuf *trailer = NULL;
 
 static struct req *reqs = NULL;
 
+/*
+ * Collects on a fixed schedule, regardless of requests. If a collection
+ * overruns the interval, the missed ticks are skipped rather than run
+ * back-to-back.
+ */
+static void
+collector_interval(struct registry *registry)
+{
+	struct timespec next, now, left;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (1) {
+		rc = registry_refresh(registry);
+		if (rc != 0)
+			tslog("metric collection failed: %s", strerror(rc));
+
+		next.tv_sec += collect_interval;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespeccmp(&next, &now, <)) {
+			tslog("collection overran the %lus interval",
+			    collect_interval);
+			next = now;
+			continue;
+		}
+		timespecsub(&next, &now, &left);
+		while (nanosleep(&left, &left) == -1 && errno == EINTR)
+			;
+	}
+}
+
+static void *
+collector_main(void *arg)
+{
+	struct registry *registry = arg;
+	uint64_t mask;
+	int rc;
+
+	if (collect_interval > 0) {
+		collector_interval(registry);
+		return (NULL);
+	}
+
+	while (1) {
+		pthread_mutex_lock(&collect_mtx);
+		while (collect_mask == 0)
+			pthread_cond_wait(&collect_cv, &collect_mtx);
+		mask = collect_mask;
+		collect_mask = 0;
+		pthread_mutex_unlock(&collect_mtx);
+
+		rc = registry_refresh_modules(registry, mask);
+		if (rc != 0)
+			tslog("metric collection failed: %s", strerror(rc));
+	}
+
+	return (NULL);
+}
+
+/*
+ * Asks the collector for a fresh snapshot, with (at least) the modules in
+ * mask collected again.
+ */
+static void
+collector_kick(uint64_t mask)
+{
+	if (collect_interval > 0)
+		return;
+	pthread_mutex_lock(&collect_mtx);
+	collect_mask |= mask;
+	pthread_cond_signal(&collect_cv);
+	pthread_mutex_unlock(&collect_mtx);
+}
+
 static void
 free_req(struct req *req)
 {
@@ -91,24 +234,145 @@ free_req(struct req *req)
 		req->prev->next = req->next;
 	if (req->next != NULL)
 		req->next->prev = req->prev;
-	fclose(req->wf);
+	close(req->sock);
+	snapshot_release(req->snap);
+	wbuf_free(req->head);
+	wbuf_free(req->body);
+	wbuf_free(req->tail);
 	free(req->parser);
 	free(req);
 }
 
+/*
+ * Writes as much of the response as the socket will take without blocking,
+ * up to SEND_CHUNK at a time. Returns 1 once it's all sent, 0 if there's
+ * more to go, or -1 on error.
+ */
+static int
+send_some(struct req *req)
+{
+	struct iovec iov[3];
+	size_t i, n, off, left;
+	ssize_t wr;
+
+	off = req->sent;
+	left = SEND_CHUNK;
+	for (i = 0, n = 0; i < 3 && left > 0; ++i) {
+		if (off >= req->iov[i].iov_len) {
+			off -= req->iov[i].iov_len;
+			continue;
+		}
+		iov[n].iov_base = (char *)req->iov[i].iov_base + off;
+		iov[n].iov_len = req->iov[i].iov_len - off;
+		if (iov[n].iov_len > left)
+			iov[n].iov_len = left;
+		left -= iov[n].iov_len;
+		off = 0;
+		++n;
+	}
+	if (n == 0)
+		return (1);
+
+	wr = writev(req->sock, iov, n);
+	if (wr < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return (0);
+		return (-1);
+	}
+	req->sent += wr;
+	return (req->sent == req->total);
+}
+
 static void
 usage(const char *arg0)
 {
-	fprintf(stderr, "usage: %s [-f] [-l logfile] [-p port]\n", arg0);
+	fprintf(stderr, "usage: %s [-f] [-i interval] [-k record=file] "
+	    "[-k replay=file[,cpus=n,pools=n,ifs=n,disks=n]] [-l logfile] "
+	    "[-m module=interval] [-p port] [-s msec] [-w workers]\n", arg0);
 	fprintf(stderr, "listens for prometheus http requests\n");
 }
 
+/*
+ * Parses a duration like "15", "15s", "2m" or "1h" into seconds. Returns -1
+ * if it isn't one.
+ */
+static int
+parse_duration(const char *str, unsigned long *secs)
+{
+	unsigned long v;
+	char *p;
+
+	errno = 0;
+	v = strtoul(str, &p, 10);
+	if (errno != 0 || p == str)
+		return (-1);
+	switch (*p) {
+	case '\0':
+	case 's':
+		break;
+	case 'm':
+		v *= 60;
+		break;
+	case 'h':
+		v *= 3600;
+		break;
+	default:
+		return (-1);
+	}
+	if (*p != '\0' && p[1] != '\0')
+		return (-1);
+	*secs = v;
+	return (0);
+}
+
+/*
+ * Parses a -k argument: record=file, or replay=file followed by how many of
+ * each thing to scale the fixture to. Returns -1 if it's invalid.
+ */
+static int
+parse_ksysctl(char *arg, char **record, char **replay,
+    struct ksysctl_scale *scale)
+{
+	enum { KS_RECORD, KS_REPLAY, KS_CPUS, KS_POOLS, KS_IFS, KS_DISKS };
+	char *const tokens[] = { "record", "replay", "cpus", "pools", "ifs",
+	    "disks", NULL };
+	u_int *counts[] = { &scale->ks_cpus, &scale->ks_pools,
+	    &scale->ks_ifs, &scale->ks_disks };
+	unsigned long v;
+	char *val, *p;
+	int opt;
+
+	while (*arg != '\0') {
+		opt = getsubopt(&arg, tokens, &val);
+		if (opt == -1 || val == NULL || *val == '\0')
+			return (-1);
+		switch (opt) {
+		case KS_RECORD:
+			*record = val;
+			break;
+		case KS_REPLAY:
+			*replay = val;
+			break;
+		default:
+			errno = 0;
+			v = strtoul(val, &p, 10);
+			if (errno != 0 || *p != '\0' || v > 65535)
+				return (-1);
+			*counts[opt - KS_CPUS] = v;
+			break;
+		}
+	}
+	if (*record != NULL && *replay != NULL)
+		return (-1);
+	return (0);
+}
+
 extern FILE *logfile;
 
 int
 main(int argc, char *argv[])
 {
-	const char *optstring = "p:fl:P";
+	const char *optstring = "p:fi:k:l:m:Ps:w:";
 	uint16_t port = 27600;
 	int daemon = 1;
 	/* XXX: default on after new pledges are in base */
@@ -131,11 +395,25 @@ main(int argc, char *argv[])
 	struct req *req, *nreq;
 	http_parser *parser;
 	int reqid = 1;
+	char **modivals;
+	size_t nmodivals = 0, i;
+	unsigned long secs;
+	unsigned long workers = 4;
+	unsigned long sample_ms = 0;
+	char *krecord = NULL, *kreplay = NULL;
+	struct ksysctl_scale kscale;
+	FILE *kf;
 
 	logfile = stdout;
+	bzero(&kscale, sizeof (kscale));
 
 	tzset();
 
+	/* -m arguments, applied once the registry exists */
+	modivals = calloc(argc, sizeof (char *));
+	if (modivals == NULL)
+		tserr(EXIT_MEMORY, "calloc(%d)", argc);
+
 	while ((c = getopt(argc, argv, optstring)) != -1) {
 		switch (c) {
 		case 'P':
@@ -157,6 +435,48 @@ main(int argc, char *argv[])
 		case 'f':
 			daemon = 0;
 			break;
+		case 'w':
+			errno = 0;
+			workers = strtoul(optarg, &p, 0);
+			if (errno != 0 || *p != '\0' || workers > 64) {
+				errx(EXIT_USAGE, "invalid argument for "
+				    "-w: '%s'", optarg);
+			}
+			break;
+		case 's':
+			errno = 0;
+			sample_ms = strtoul(optarg, &p, 0);
+			if (errno != 0 || *p != '\0' || sample_ms < 10 ||
+			    sample_ms > 60000) {
+				errx(EXIT_USAGE, "invalid argument for "
+				    "-s: '%s'", optarg);
+			}
+			break;
+		case 'i':
+			if (parse_duration(optarg, &collect_interval) != 0 ||
+			    collect_interval == 0) {
+				errx(EXIT_USAGE, "invalid argument for "
+				    "-i: '%s'", optarg);
+			}
+			break;
+		case 'm':
+			p = strchr(optarg, '=');
+			if (p == NULL || parse_duration(p + 1, &secs) != 0) {
+				errx(EXIT_USAGE, "invalid argument for "
+				    "-m: '%s'", optarg);
+			}
+			modivals[nmodivals++] = optarg;
+			break;
+		case 'k':
+			p = strdup(optarg);
+			if (p == NULL)
+				tserr(EXIT_MEMORY, "strdup");
+			if (parse_ksysctl(p, &krecord, &kreplay,
+			    &kscale) != 0) {
+				errx(EXIT_USAGE, "invalid argument for "
+				    "-k: '%s'", optarg);
+			}
+			break;
 		case 'l':
 			logfile = fopen(optarg, "a");
 			if (logfile == NULL)
@@ -168,6 +488,23 @@ main(int argc, char *argv[])
 		}
 	}
 
+	/* before the chdir, so that relative paths work */
+	if (krecord != NULL) {
+		kf = fopen(krecord, "w");
+		if (kf == NULL)
+			err(EXIT_USAGE, "open('%s')", krecord);
+		ksysctl_record(kf);
+	}
+	if (kreplay != NULL) {
+		kf = fopen(kreplay, "r");
+		if (kf == NULL)
+			err(EXIT_USAGE, "open('%s')", kreplay);
+		rc = ksysctl_replay(kf, &kscale);
+		if (rc != 0)
+			errc(EXIT_USAGE, rc, "-k: '%s'", kreplay);
+		fclose(kf);
+	}
+
 	if (daemon) {
 		kid = fork();
 		if (kid < 0) {
@@ -185,7 +522,29 @@ main(int argc, char *argv[])
 		close(STDERR_FILENO);
 	}
 
-	registry = registry_build();
+	registry = registry_build(modules);
+
+	for (i = 0; i < nmodivals; ++i) {
+		p = strchr(modivals[i], '=');
+		*p++ = '\0';
+		(void) parse_duration(p, &secs);
+		if (registry_set_interval(registry, modivals[i], secs) != 0)
+			tserrx(EXIT_USAGE, "-m: unknown module '%s'",
+			    modivals[i]);
+	}
+	free(modivals);
+	registry_set_workers(registry, workers);
+	registry_set_sampler(registry, sample_ms);
+
+	/* the first request shouldn't have to wait for a collection */
+	rc = registry_refresh(registry);
+	if (rc != 0)
+		tslog("initial metric collection failed: %s", strerror(rc));
+	rc = pthread_create(&collector, NULL, collector_main, registry);
+	if (rc != 0) {
+		errno = rc;
+		tserr(EXIT_ERROR, "pthread_create");
+	}
 
 	bzero(&settings, sizeof (settings));
 	settings.on_headers_complete = on_headers_complete;
@@ -297,12 +656,11 @@ main(int argc, char *argv[])
 
 			parser = NULL;
 
-			req->wf = fdopen(sock, "w");
-			if (req->wf == NULL) {
-				tslog("failed to fdopen socket: %s",
+			if (fcntl(sock, F_SETFL, O_NONBLOCK) < 0) {
+				tslog("failed to make socket non-blocking: %s",
 				    strerror(errno));
 				close(req->sock);
-				free(parser);
+				free(req->parser);
 				free(req);
 				continue;
 			}
@@ -373,6 +731,21 @@ check_pfds:
 					continue;
 				}
 			}
+			if (req->sending &&
+			    (pfds[req->pfdnum].revents & POLLOUT)) {
+				rc = send_some(req);
+				if (rc < 0) {
+					tslog("error sending to %d: %s",
+					    req->id, strerror(errno));
+					free_req(req);
+					continue;
+				}
+				req->last_active = now;
+				if (rc == 1) {
+					free_req(req);
+					continue;
+				}
+			}
 			if (pfds[req->pfdnum].revents & POLLHUP) {
 				http_parser_execute(req->parser, &settings,
 				    buf, 0);
@@ -405,6 +778,8 @@ check_timeouts:
 			req->pfdnum = upfds;
 			pfds[upfds].fd = req->sock;
 			pfds[upfds].events = POLLIN | POLLHUP;
+			if (req->sending)
+				pfds[upfds].events = POLLOUT | POLLHUP;
 			pfds[upfds].revents = 0;
 			++upfds;
 		}
@@ -413,17 +788,26 @@ check_timeouts:
 	free(buf);
 	free(pfds);
 
-	free(stats_buf);
-	stats_buf_sz = 0;
-
 	registry_free(registry);
 	return (0);
 }
 
+/* Appends as much of p as fits to a NUL-terminated buffer */
+static void
+append_trunc(char *buf, size_t size, size_t *len, const char *p, size_t n)
+{
+	if (n > size - 1 - *len)
+		n = size - 1 - *len;
+	bcopy(p, buf + *len, n);
+	*len += n;
+	buf[*len] = '\0';
+}
+
 static int
 on_url(http_parser *parser, const char *url, size_t ulen)
 {
 	struct req *req = parser->data;
+	append_trunc(req->url, sizeof (req->url), &req->urllen, url, ulen);
 	if (parser->method == HTTP_GET &&
 	    ulen >= strlen("/metrics") &&
 	    strncmp(url, "/metrics", strlen("/metrics")) == 0) {
@@ -440,98 +824,352 @@ on_url(http_parser *parser, const char *url, size_t ulen)
 static int
 on_header_field(http_parser *parser, const char *hdrname, size_t hlen)
 {
-	//struct req *req = parser->data;
+	struct req *req = parser->data;
+
+	/* a field after a value is the start of the next header */
+	if (req->in_value) {
+		req->hdrnamelen = 0;
+		req->in_value = 0;
+	}
+	append_trunc(req->hdrname, sizeof (req->hdrname), &req->hdrnamelen,
+	    hdrname, hlen);
 	return (0);
 }
 
+/*
+ * Appends (part of) a header value. Repeated headers are the same as a
+ * single comma-separated list.
+ */
+static void
+append_value(struct req *req, char *buf, size_t size, size_t *len,
+    const char *p, size_t n)
+{
+	if (!req->in_value && *len > 0)
+		append_trunc(buf, size, len, ",", 1);
+	append_trunc(buf, size, len, p, n);
+}
+
 static int
 on_header_value(http_parser *parser, const char *hdrval, size_t vlen)
 {
-	//struct req *req = parser->data;
+	struct req *req = parser->data;
+
+	if (strcasecmp(req->hdrname, "Accept") == 0) {
+		append_value(req, req->accept, sizeof (req->accept),
+		    &req->acceptlen, hdrval, vlen);
+	} else if (strcasecmp(req->hdrname, "Accept-Encoding") == 0) {
+		append_value(req, req->acceptenc, sizeof (req->acceptenc),
+		    &req->acceptenclen, hdrval, vlen);
+	}
+	req->in_value = 1;
+	return (0);
+}
+
+static char *
+strip(char *str)
+{
+	char *end;
+
+	while (isspace((unsigned char)*str))
+		++str;
+	end = str + strlen(str);
+	while (end > str && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+	return (str);
+}
+
+/*
+ * Picks the format to respond in from an Accept header, by q value. Ties go
+ * to whichever was listed first, and if nothing we know of is acceptable we
+ * send text anyway.
+ */
+static enum metrics_format
+negotiate_format(char *accept)
+{
+	char *range, *type, *param;
+	enum metrics_format fmt, best = METRICS_FMT_TEXT;
+	double q, bestq = 0;
+	int proto, delimited;
+
+	while ((range = strsep(&accept, ",")) != NULL) {
+		type = strip(strsep(&range, ";"));
+		q = 1.0;
+		proto = 0;
+		delimited = 0;
+		while ((param = strsep(&range, ";")) != NULL) {
+			param = strip(param);
+			if (strncasecmp(param, "q=", 2) == 0)
+				q = strtod(param + 2, NULL);
+			else if (strcmp(param,
+			    "proto=io.prometheus.client.MetricFamily") == 0)
+				proto = 1;
+			else if (strcasecmp(param, "encoding=delimited") == 0)
+				delimited = 1;
+		}
+
+		if (strcasecmp(type, "application/vnd.google.protobuf") == 0) {
+			if (!proto || !delimited)
+				continue;
+			fmt = METRICS_FMT_PROTOBUF;
+		} else if (strcasecmp(type,
+		    "application/openmetrics-text") == 0) {
+			fmt = METRICS_FMT_OPENMETRICS;
+		} else if (strcasecmp(type, "text/plain") == 0 ||
+		    strcasecmp(type, "text/*") == 0 ||
+		    strcmp(type, "*/*") == 0) {
+			fmt = METRICS_FMT_TEXT;
+		} else {
+			continue;
+		}
+
+		if (q > bestq) {
+			best = fmt;
+			bestq = q;
+		}
+	}
+	return (best);
+}
+
+/* Whether an Accept-Encoding header allows gzip */
+static int
+accepts_gzip(char *acceptenc)
+{
+	char *coding, *name, *param;
+	double q, gzipq = -1, anyq = -1;
+
+	while ((coding = strsep(&acceptenc, ",")) != NULL) {
+		name = strip(strsep(&coding, ";"));
+		q = 1.0;
+		while ((param = strsep(&coding, ";")) != NULL) {
+			param = strip(param);
+			if (strncasecmp(param, "q=", 2) == 0)
+				q = strtod(param + 2, NULL);
+		}
+		if (strcasecmp(name, "gzip") == 0 ||
+		    strcasecmp(name, "x-gzip") == 0)
+			gzipq = q;
+		else if (strcmp(name, "*") == 0)
+			anyq = q;
+	}
+	/* "*" only counts if gzip wasn't mentioned explicitly */
+	if (gzipq >= 0)
+		return (gzipq > 0);
+	return (anyq > 0);
+}
+
+/* Decodes %xx escapes and '+' in place */
+static void
+urldecode(char *str)
+{
+	char *o = str;
+	char hex[3];
+
+	hex[2] = '\0';
+	while (*str != '\0') {
+		if (str[0] == '%' && isxdigit((unsigned char)str[1]) &&
+		    isxdigit((unsigned char)str[2])) {
+			hex[0] = str[1];
+			hex[1] = str[2];
+			*o++ = strtol(hex, NULL, 16);
+			str += 3;
+		} else if (*str == '+') {
+			*o++ = ' ';
+			++str;
+		} else {
+			*o++ = *str++;
+		}
+	}
+	*o = '\0';
+}
+
+/*
+ * Fills in the request's filter from collect[]=module and name[]=prefix in
+ * the query string. Returns -1 if one of them is no good.
+ */
+static int
+parse_query(struct req *req)
+{
+	char *query, *param, *val;
+
+	query = strchr(req->url, '?');
+	if (query == NULL)
+		return (0);
+	*query++ = '\0';
+
+	while ((param = strsep(&query, "&")) != NULL) {
+		val = strchr(param, '=');
+		if (val == NULL)
+			continue;
+		*val++ = '\0';
+		urldecode(param);
+		urldecode(val);
+		if (strcmp(param, "collect[]") == 0) {
+			if (registry_module_mask(req->registry, val,
+			    &req->filter.mf_modules) != 0) {
+				tslog("req %d: no module '%s'", req->id, val);
+				return (-1);
+			}
+			req->filtered = 1;
+		} else if (strcmp(param, "name[]") == 0) {
+			if (req->nnames >= MAX_FILTER_NAMES) {
+				tslog("req %d: too many name[]s", req->id);
+				return (-1);
+			}
+			req->names[req->nnames++] = val;
+			req->filter.mf_names = req->names;
+			req->filtered = 1;
+		}
+	}
 	return (0);
 }
 
 static int
 on_headers_complete(http_parser *parser)
 {
-	//struct req *req = parser->data;
+	struct req *req = parser->data;
+
+	if (parse_query(req) != 0)
+		req->badquery = 1;
+
+	req->fmt = negotiate_format(req->accept);
+	req->gzip = accepts_gzip(req->acceptenc);
 	return (0);
 }
 
+/* Sets up the response to be sent, and sends what we can of it right now */
+static void
+start_response(struct req *req)
+{
+	int rc;
+
+	req->iov[0].iov_base = (void *)wbuf_data(req->head);
+	req->iov[0].iov_len = wbuf_len(req->head);
+	req->total = req->iov[0].iov_len + req->iov[1].iov_len +
+	    req->iov[2].iov_len;
+	req->sent = 0;
+	req->sending = 1;
+
+	rc = send_some(req);
+	if (rc != 0) {
+		if (rc < 0) {
+			tslog("error sending to %d: %s", req->id,
+			    strerror(errno));
+		}
+		req->done = 1;
+	}
+}
+
 static void
 send_err(http_parser *parser, enum http_status status)
 {
 	struct req *req = parser->data;
 	tslog("sending http %d", status);
-	fprintf(req->wf, "HTTP/%d.%d %d %s\r\n", parser->http_major,
+	req->head = wbuf_new(256);
+	wbuf_printf(req->head, "HTTP/%d.%d %d %s\r\n", parser->http_major,
 	    parser->http_minor, status, http_status_str(status));
-	fprintf(req->wf, "Server: obsd-prom-exporter\r\n");
-	fprintf(req->wf, "Connection: close\r\n");
-	fprintf(req->wf, "\r\n");
-	fflush(req->wf);
-	req->done = 1;
+	wbuf_puts(req->head, "Server: obsd-prom-exporter\r\n");
+	wbuf_puts(req->head, "Connection: close\r\n");
+	wbuf_puts(req->head, "\r\n");
+	start_response(req);
 }
 
 static int
 on_message_complete(http_parser *parser)
 {
 	struct req *req = parser->data;
-	FILE *mf;
-	off_t off;
-	int r;
+	struct snapshot *snap;
+	struct timespec collected, now, age;
+	enum metrics_format fmt;
+	int gzip = 0;
+	size_t len;
+
+	/* we close after one response, so ignore any pipelined requests */
+	if (req->sending)
+		return (0);
 
 	if (req->resp == RESP_NOT_FOUND) {
 		send_err(parser, 404);
 		return (0);
 	}
+	if (req->badquery) {
+		send_err(parser, 400);
+		return (0);
+	}
 
-	if (stats_buf == NULL) {
-		stats_buf_sz = 256*1024;
-		stats_buf = malloc(stats_buf_sz);
+	snap = registry_snapshot(req->registry);
+	fmt = req->fmt;
+	if (snap != NULL && snapshot_data(snap, fmt) == NULL) {
+		/* have it rendered from now on, and make do with text */
+		registry_want_format(req->registry, fmt);
+		fmt = METRICS_FMT_TEXT;
 	}
-	if (stats_buf == NULL) {
-		tslog("failed to allocate metrics buffer");
-		send_err(parser, 500);
-		return (0);
+	/* filtered responses are cut out of the snapshot, so not gzipped */
+	if (snap != NULL && req->gzip && !req->filtered) {
+		/* likewise, compressed */
+		if (snapshot_gzip_data(snap, fmt) != NULL)
+			gzip = 1;
+		else
+			registry_want_gzip(req->registry, req->fmt);
 	}
-	mf = fmemopen(stats_buf, stats_buf_sz, "w");
-	if (mf == NULL) {
-		tslog("fmemopen failed: %s", strerror(errno));
-		send_err(parser, 500);
+	/* whatever we send now, the next request should see newer data */
+	collector_kick(req->filter.mf_modules != 0 ?
+	    req->filter.mf_modules : UINT64_MAX);
+	if (snap == NULL) {
+		tslog("no metrics collected yet for req %d", req->id);
+		send_err(parser, 503);
 		return (0);
 	}
 
-	tslog("generating metrics for req %d...", req->id);
-	r = registry_collect(req->registry);
-	if (r != 0) {
-		tslog("metric collection failed: %s", strerror(r));
-		send_err(parser, 500);
-		return (0);
+	snapshot_collected(snap, &collected);
+	clock_gettime(CLOCK_REALTIME, &now);
+	timespecsub(&now, &collected, &age);
+	if (trailer == NULL)
+		trailer = wbuf_new(512);
+	wbuf_reset(trailer);
+	print_gauge(trailer, fmt, "exporter_last_collection_timestamp_seconds",
+	    "When the metrics being served were collected",
+	    collected.tv_sec + collected.tv_nsec / 1e9);
+	print_gauge(trailer, fmt, "exporter_collection_age_seconds",
+	    "How long ago the metrics being served were collected",
+	    age.tv_sec + age.tv_nsec / 1e9);
+	print_end(trailer, fmt);
+
+	req->snap = snap;
+	req->tail = wbuf_new(512);
+	if (gzip) {
+		snapshot_gzip_finish(snap, fmt, req->tail, wbuf_data(trailer),
+		    wbuf_len(trailer));
+		req->iov[1].iov_base = (void *)snapshot_gzip_data(snap, fmt);
+		req->iov[1].iov_len = snapshot_gzip_len(snap, fmt);
+	} else if (req->filtered) {
+		wbuf_append(req->tail, wbuf_data(trailer), wbuf_len(trailer));
+		req->body = wbuf_new(4096);
+		snapshot_filter(snap, fmt, &req->filter, req->body);
+		req->iov[1].iov_base = (void *)wbuf_data(req->body);
+		req->iov[1].iov_len = wbuf_len(req->body);
+	} else {
+		wbuf_append(req->tail, wbuf_data(trailer), wbuf_len(trailer));
+		req->iov[1].iov_base = (void *)snapshot_data(snap, fmt);
+		req->iov[1].iov_len = snapshot_len(snap, fmt);
 	}
-	print_registry(mf, req->registry);
-	fflush(mf);
-	off = ftell(mf);
-	if (off < 0) {
-		send_err(parser, 500);
-		return (0);
-	}
-	fclose(mf);
-	tslog("%d done, sending %lld bytes", req->id, off);
+	req->iov[2].iov_base = (void *)wbuf_data(req->tail);
+	req->iov[2].iov_len = wbuf_len(req->tail);
+
+	len = req->iov[1].iov_len + req->iov[2].iov_len;
+	tslog("%d sending %zu bytes", req->id, len);
 
-	fprintf(req->wf, "HTTP/%d.%d %d %s\r\n", parser->http_major,
+	req->head = wbuf_new(512);
+	wbuf_printf(req->head, "HTTP/%d.%d %d %s\r\n", parser->http_major,
 	    parser->http_minor, 200, http_status_str(200));
-	fprintf(req->wf, "Server: obsd-prom-exporter\r\n");
-	fprintf(req->wf, "Content-Type: "
-	    "text/plain; version=0.0.4; charset=utf-8\r\n");
-	fprintf(req->wf, "Content-Length: %lld\r\n", off);
-	fprintf(req->wf, "Connection: close\r\n");
-	fprintf(req->wf, "\r\n");
-	fflush(req->wf);
-
-	fprintf(req->wf, "%s", stats_buf);
-	fflush(req->wf);
-
-	req->done = 1;
+	wbuf_puts(req->head, "Server: obsd-prom-exporter\r\n");
+	wbuf_printf(req->head, "Content-Type: %s\r\n",
+	    metrics_format_content_type(fmt));
+	if (gzip)
+		wbuf_puts(req->head, "Content-Encoding: gzip\r\n");
+	wbuf_printf(req->head, "Content-Length: %zu\r\n", len);
+	wbuf_puts(req->head, "Connection: close\r\n");
+	wbuf_puts(req->head, "\r\n");
+	start_response(req);
 
 	return (0);
 }
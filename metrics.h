@@ -30,14 +30,30 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 
 struct metric;
+struct metric_val;
+struct wbuf;
+struct snapshot;
 struct label;
 struct registry;
 
 struct metrics_module_ops {
+	const char *mm_name;
+	/*
+	 * Minimum number of seconds between collections, for modules which
+	 * are expensive to collect. Zero means every registry_collect().
+	 */
+	unsigned int mm_interval;
 	void (*mm_register)(struct registry *db, void **modprivate);
 	int (*mm_collect)(void *modprivate);
+	/*
+	 * Optional: reads cheap counters for burst_sample(), every few ms if
+	 * registry_set_sampler() is used. Runs on a thread of its own, so it
+	 * mustn't touch any metrics, or anything mm_collect does.
+	 */
+	void (*mm_sample)(void *modprivate);
 	void (*mm_free)(void *modprivate);
 };
 
@@ -55,9 +71,40 @@ enum metric_val_type {
 
 enum metric_type {
 	METRIC_GAUGE,
-	METRIC_COUNTER
+	METRIC_COUNTER,
+	METRIC_HISTOGRAM,
+	METRIC_SUMMARY
 };
 
+/*
+ * How each metric in a registry indexes its values for lookup by labels.
+ * The hash index compares double-typed labels exactly, rather than within
+ * a small epsilon as the tree does.
+ */
+enum registry_index {
+	REGISTRY_INDEX_TREE,
+	REGISTRY_INDEX_HASH
+};
+
+/*
+ * Where the numbers of gauges and counters are kept. With columns, each
+ * metric keeps them in dense arrays instead of in each value, which makes
+ * rendering large metrics in the text format (and noticing that they haven't
+ * changed, for snapshots) cheaper.
+ */
+enum registry_layout {
+	REGISTRY_LAYOUT_ROWS,
+	REGISTRY_LAYOUT_COLUMNS
+};
+
+/* Exposition formats which a registry can be rendered in */
+enum metrics_format {
+	METRICS_FMT_TEXT,		/* text/plain; version=0.0.4 */
+	METRICS_FMT_OPENMETRICS,	/* OpenMetrics 1.0.0 text */
+	METRICS_FMT_PROTOBUF		/* delimited io.prometheus.client */
+};
+#define	METRICS_FMT_COUNT	3
+
 struct label *metric_label_new(const char *name, enum metric_val_type type);
 
 struct metric *metric_new(struct registry *r, const char *name,
@@ -65,11 +112,118 @@ struct metric *metric_new(struct registry *r, const char *name,
     void *priv, const struct metric_ops *ops,
     ... /* struct label *, NULL */);
 
+/*
+ * Metrics can also be declared in a const table, rather than a call to
+ * metric_new() with varargs for each. Metrics with the same labels share an
+ * array of label descriptions.
+ */
+struct metric_label_desc {
+	const char		*mld_name;
+	enum metric_val_type	 mld_type;
+};
+
+struct metric_desc {
+	const char			*md_name;
+	const char			*md_help;
+	enum metric_type		 md_type;
+	enum metric_val_type		 md_val_type;
+	const struct metric_label_desc	*md_labels;
+	size_t				 md_nlabels;
+};
+
+/* A label value, of the member matching the label's mld_type */
+union metric_label_val {
+	const char	*mlv_string;
+	int64_t		 mlv_int64;
+	uint64_t	 mlv_uint64;
+	double		 mlv_double;
+};
+
+/*
+ * Creates the n metrics in a table (which can't include histograms or
+ * summaries), storing them in ms[].
+ */
+void metric_new_table(struct registry *r, const struct metric_desc *d,
+    size_t n, void *priv, const struct metric_ops *ops, struct metric **ms);
+
+/*
+ * Creates a histogram with fixed buckets, whose upper bounds must be given in
+ * increasing order (the +Inf bucket is implicit). Values are added with
+ * metric_val_observe().
+ */
+struct metric *metric_new_histogram(struct registry *r, const char *name,
+    const char *help, const double *bounds, size_t nbounds, void *priv,
+    const struct metric_ops *ops, ... /* struct label *, NULL */);
+
+/*
+ * Creates a histogram with exponential buckets, laid out like a Prometheus
+ * native histogram: each bucket's upper bound is 2^(2^-schema) times the last
+ * one's (schema is from -4 to 8). Observations within min of zero count
+ * towards the zero bucket. metric_val_observe() returns ERANGE for those
+ * further below zero or above max, which a native histogram would need
+ * buckets outside the range for.
+ *
+ * The protobuf format exposes these as native histograms. The text formats
+ * have to list every bucket between min and max, so keep the range narrow (or
+ * the schema low) for those.
+ */
+struct metric *metric_new_histogram_exp(struct registry *r, const char *name,
+    const char *help, int schema, double min, double max, void *priv,
+    const struct metric_ops *ops, ... /* struct label *, NULL */);
+
+/*
+ * Creates a summary, which reports the given quantiles (each from 0 to 1) of
+ * the last window observations of each value, along with the count and sum
+ * of all of them. Values are added with metric_val_observe().
+ */
+struct metric *metric_new_summary(struct registry *r, const char *name,
+    const char *help, const double *quantiles, size_t nquantiles,
+    size_t window, void *priv, const struct metric_ops *ops,
+    ... /* struct label *, NULL */);
+
+/*
+ * Adds a gauge with the per-second rate of each of a counter's values,
+ * averaged over its last nsamples collections. Each value keeps a ring of
+ * that many samples, so with a short collection interval (-i) the rate can
+ * follow changes faster than Prometheus scrapes. Must be called before the
+ * counter has any values. Returns EINVAL for anything but a numeric counter.
+ */
+int metric_track_rate(struct metric *m, const char *name, const char *help,
+    size_t nsamples);
+/* Enough samples for a rate to ride out one slow or missed collection */
+#define	METRIC_RATE_SAMPLES	4
+
+/*
+ * Bursts catch what happens between collections, by sampling counters much
+ * more often (from mm_sample) and keeping the increase over each sample
+ * interval, up to BURST_DEPTH of them per counter. Each collection feeds
+ * those since the last one into a summary from metric_new_burst(), which has
+ * quantiles 0, 0.99 and 1: the min, p99 and max increase per interval. Its
+ * count and sum are of all intervals ever.
+ */
+#define	BURST_DEPTH	256
+struct burst;
+struct metric *metric_new_burst(struct registry *r, const char *name,
+    const char *help, void *priv, const struct metric_ops *ops,
+    ... /* struct label *, NULL */);
+struct burst *burst_new(void);
+void burst_free(struct burst *b);
+/* Records the current value of a counter, identified by a module's key */
+void burst_sample(struct burst *b, uint64_t key, uint64_t v);
+/* Whether the counter has been sampled (which it won't be, without -s) */
+int burst_sampled(struct burst *b, uint64_t key);
+/* Moves the counter's increases into a value of a metric_new_burst() */
+void burst_flush(struct burst *b, uint64_t key, struct metric_val *mv);
+/* Forgets a counter which has gone away */
+void burst_forget(struct burst *b, uint64_t key);
+
 /* Removes all metric values, new and old */
 void metric_clear(struct metric *m);
 /*
  * Removes all metric values which have not been updated in the current
- * collection cycle (i.e. since registry_collect() was called)
+ * collection cycle (i.e. since registry_collect() was called). This is done
+ * automatically for metrics after the module which registered them (or their
+ * own mo_collect) has collected, so collectors don't need to call it.
  */
 void metric_clear_old_values(struct metric *m);
 
@@ -81,12 +235,167 @@ int metric_inc(struct metric *m, ... /* label values */);
 /* Updates a metric value to a new value */
 int metric_update(struct metric *m, ... /* label values, metric value */);
 
-struct registry *registry_build(void);
+/*
+ * Returns a handle to the metric value with the given labels, creating it if
+ * necessary. Updates through the handle skip the label lookup entirely.
+ *
+ * The handle stays valid until metric_val_release(), even if the value is
+ * removed as stale in the meantime: setting it again puts
+ * it back. All handles must be released before the registry is freed.
+ */
+struct metric_val *metric_val_get(struct metric *m, ... /* label values */);
+void metric_val_release(struct metric_val *mv);
+/*
+ * Gets handles to the values of n metrics with the same labels, one label
+ * value per label, storing them in mvs[].
+ */
+void metric_val_get_table(struct metric *const *ms, size_t n,
+    const union metric_label_val *lv, struct metric_val **mvs);
+/* Releases n handles, and sets them to NULL */
+void metric_val_release_table(struct metric_val **mvs, size_t n);
+
+int metric_val_set_int64(struct metric_val *mv, int64_t v);
+int metric_val_set_uint64(struct metric_val *mv, uint64_t v);
+int metric_val_set_double(struct metric_val *mv, double v);
+/*
+ * Sets n values, each through its handle in mvs[]. Returns EINVAL if any of
+ * them has the wrong type, after setting all the others.
+ */
+int metric_vals_set_int64(struct metric_val *const *mvs, const int64_t *v,
+    size_t n);
+int metric_vals_set_uint64(struct metric_val *const *mvs, const uint64_t *v,
+    size_t n);
+int metric_vals_set_double(struct metric_val *const *mvs, const double *v,
+    size_t n);
+int metric_val_inc(struct metric_val *mv);
+/* Adds an observation to a histogram or summary */
+int metric_val_observe(struct metric_val *mv, double v);
+
+/*
+ * Creates a registry of the exporter's own metrics and those of the modules
+ * in the NULL-terminated list.
+ */
+struct registry *registry_build(struct metrics_module_ops *const *modops);
 struct registry *registry_new_empty(void);
 void registry_free(struct registry *);
 int registry_collect(struct registry *r);
+/*
+ * Like registry_collect(), but only collects the modules in mask (see
+ * registry_module_mask()). The others keep their values from last time.
+ */
+int registry_collect_modules(struct registry *r, uint64_t mask);
+/*
+ * Adds the named module to a mask of modules. Returns ENOENT if there's no
+ * such module.
+ */
+int registry_module_mask(struct registry *r, const char *modname,
+    uint64_t *mask);
+/*
+ * Starts n threads to collect modules in parallel with. Without this (or with
+ * n = 0), registry_collect() collects them one at a time.
+ */
+int registry_set_workers(struct registry *r, unsigned int n);
+/*
+ * Starts a thread which calls each module's mm_sample every ms milliseconds.
+ * Its CPU time is exported as exporter_sampler_cpu_seconds_total.
+ */
+int registry_set_sampler(struct registry *r, unsigned int ms);
+/*
+ * Overrides the mm_interval of the named module. Returns ENOENT if there's
+ * no such module.
+ */
+int registry_set_interval(struct registry *r, const char *modname,
+    unsigned int secs);
+/* Switches the index used by all metrics, re-indexing any existing values */
+void registry_set_index(struct registry *r, enum registry_index idx);
+/* Switches the layout of all metrics, moving any existing values */
+void registry_set_layout(struct registry *r, enum registry_layout layout);
+
+/*
+ * Growable output buffer. The exposition is rendered into one of these and
+ * then written out in one go, rather than going through stdio per value.
+ */
+struct wbuf *wbuf_new(size_t hint);
+void wbuf_free(struct wbuf *b);
+void wbuf_reset(struct wbuf *b);
+const char *wbuf_data(const struct wbuf *b);
+size_t wbuf_len(const struct wbuf *b);
+void wbuf_append(struct wbuf *b, const void *p, size_t n);
+void wbuf_puts(struct wbuf *b, const char *str);
+void wbuf_putc(struct wbuf *b, char c);
+void wbuf_printf(struct wbuf *b, const char *fmt, ...);
+void wbuf_put_uint64(struct wbuf *b, uint64_t v);
+void wbuf_put_int64(struct wbuf *b, int64_t v);
+/*
+ * Always round-trips, occasionally a digit longer than the shortest form
+ * which does. NaN and infinities are written as NaN, +Inf and -Inf.
+ */
+void wbuf_put_double(struct wbuf *b, double v);
+
+void print_metric(struct wbuf *b, const struct metric *m);
+void print_registry(struct wbuf *b, const struct registry *r);
+void print_registry_fmt(struct wbuf *b, const struct registry *r,
+    enum metrics_format fmt);
+/* Renders a lone unlabelled gauge, for values which aren't in a registry */
+void print_gauge(struct wbuf *b, enum metrics_format fmt, const char *name,
+    const char *help, double v);
+/* Finishes off an exposition: OpenMetrics has to end with "# EOF" */
+void print_end(struct wbuf *b, enum metrics_format fmt);
+const char *metrics_format_content_type(enum metrics_format fmt);
 
-void print_metric(FILE *f, const struct metric *m);
-void print_registry(FILE *f, const struct registry *r);
+/*
+ * Snapshots are immutable renderings of the whole registry, so requests can
+ * be served while the next collection is running in another thread.
+ *
+ * registry_publish() renders the registry and makes the result the current
+ * snapshot; registry_refresh() collects first. Only one thread may call these
+ * (or otherwise touch the metrics) at a time. registry_snapshot() and
+ * snapshot_release() are safe to call from any thread.
+ */
+int registry_publish(struct registry *r);
+int registry_refresh(struct registry *r);
+int registry_refresh_modules(struct registry *r, uint64_t mask);
+/*
+ * Returns a reference to the current snapshot, or NULL if there isn't one.
+ * All references must be released before the registry is freed.
+ */
+struct snapshot *registry_snapshot(struct registry *r);
+void snapshot_release(struct snapshot *s);
+/*
+ * Snapshots are always rendered in text format, and in any others which have
+ * been asked for with registry_want_format() before they were published.
+ * snapshot_data() returns NULL for formats a snapshot doesn't have.
+ */
+void registry_want_format(struct registry *r, enum metrics_format fmt);
+const char *snapshot_data(const struct snapshot *s, enum metrics_format fmt);
+size_t snapshot_len(const struct snapshot *s, enum metrics_format fmt);
+/*
+ * Like registry_want_format(), but the snapshots are also gzipped, and the
+ * start of the gzip stream is available from snapshot_gzip_data().
+ * snapshot_gzip_finish() writes the rest of it into b, with extra data
+ * appended to the snapshot's (so the whole stream inflates to snapshot_data()
+ * followed by extra).
+ */
+void registry_want_gzip(struct registry *r, enum metrics_format fmt);
+const char *snapshot_gzip_data(const struct snapshot *s,
+    enum metrics_format fmt);
+size_t snapshot_gzip_len(const struct snapshot *s, enum metrics_format fmt);
+void snapshot_gzip_finish(const struct snapshot *s, enum metrics_format fmt,
+    struct wbuf *b, const void *extra, size_t n);
+/*
+ * Selects part of a snapshot: the metric families registered by one of the
+ * modules in mf_modules (or any, if it's 0; the exporter's own metrics always
+ * match), with names starting with one of mf_names (a NULL-terminated array,
+ * or NULL for any name).
+ */
+struct metrics_filter {
+	uint64_t mf_modules;
+	const char **mf_names;
+};
+/* Appends the families in the snapshot which match the filter to b */
+void snapshot_filter(const struct snapshot *s, enum metrics_format fmt,
+    const struct metrics_filter *f, struct wbuf *b);
+/* CLOCK_REALTIME at the end of the collection the snapshot was made from */
+void snapshot_collected(const struct snapshot *s, struct timespec *ts);
 
 #endif /* _METRICS_H */